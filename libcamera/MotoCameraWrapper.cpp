@@ -18,6 +18,7 @@
 
 #include <cmath>
 #include <dlfcn.h>
+#include <cutils/atomic.h>
 #include <fcntl.h>
 #include <cutils/properties.h>
 #include <linux/videodev2.h>
@@ -161,6 +162,10 @@ MotoCameraWrapper::MotoCameraWrapper(sp<CameraHardwareInterface>& motoInterface,
     mMotoInterface(motoInterface),
     mCameraType(type),
     mVideoMode(false),
+    mLastSetResult(NO_ERROR),
+    mLastSetVersion(-1),
+    mParamsVersion(0),
+    mCachedVersion(-1),
     mNotifyCb(NULL),
     mDataCb(NULL),
     mDataCbTimestamp(NULL),
@@ -230,6 +235,9 @@ MotoCameraWrapper::notifyCb(int32_t msgType, int32_t ext1, int32_t ext2, void* u
     MotoCameraWrapper *_this = (MotoCameraWrapper *) user;
     user = _this->mCbUserData;
 
+    /* the lib updates parameters behind our back on notifies, e.g. the
+       focus distances after focusing or the zoom level while zooming */
+    _this->invalidateParameters();
     if (msgType == CAMERA_MSG_FOCUS) {
         _this->toggleTorchIfNeeded();
     }
@@ -326,6 +334,7 @@ MotoCameraWrapper::msgTypeEnabled(int32_t msgType)
 status_t
 MotoCameraWrapper::startPreview()
 {
+    invalidateParameters();
     return mMotoInterface->startPreview();
 }
 
@@ -344,6 +353,7 @@ MotoCameraWrapper::setOverlay(const sp<Overlay> &overlay)
 void
 MotoCameraWrapper::stopPreview()
 {
+    invalidateParameters();
     mMotoInterface->stopPreview();
 }
 
@@ -357,6 +367,7 @@ status_t
 MotoCameraWrapper::startRecording()
 {
     toggleTorchIfNeeded();
+    invalidateParameters();
     return mMotoInterface->startRecording();
 }
 
@@ -364,6 +375,7 @@ void
 MotoCameraWrapper::stopRecording()
 {
     toggleTorchIfNeeded();
+    invalidateParameters();
     mMotoInterface->stopRecording();
 }
 
@@ -382,6 +394,7 @@ MotoCameraWrapper::releaseRecordingFrame(const sp<IMemory>& mem)
 status_t
 MotoCameraWrapper::autoFocus()
 {
+    invalidateParameters();
     return mMotoInterface->autoFocus();
 }
 
@@ -394,6 +407,7 @@ MotoCameraWrapper::cancelAutoFocus()
 status_t
 MotoCameraWrapper::takePicture()
 {
+    invalidateParameters();
     return mMotoInterface->takePicture();
 }
 
@@ -406,7 +420,16 @@ MotoCameraWrapper::cancelPicture()
 status_t
 MotoCameraWrapper::setParameters(const CameraParameters& params)
 {
-    CameraParameters pars(params.flatten());
+    String8 flatParams = params.flatten();
+
+    /* apps tend to set the same parameters over and over */
+    if (!mLastSetParams.isEmpty() && flatParams == mLastSetParams &&
+        mLastSetVersion == android_atomic_acquire_load(&mParamsVersion)) {
+        LOGV("%s: parameters unchanged", __func__);
+        return mLastSetResult;
+    }
+
+    CameraParameters pars(params);
     String8 oldFlashMode = mFlashMode;
     String8 sceneMode;
     status_t retval;
@@ -461,7 +484,22 @@ MotoCameraWrapper::setParameters(const CameraParameters& params)
     /* kill off the original setting */
     pars.set(CameraParameters::KEY_EXPOSURE_COMPENSATION, "0");
 
-    retval = mMotoInterface->setParameters(pars);
+    /* The lib validates the complete set on every call, so a partial set
+       can't be forwarded; skip the call if nothing it sees has changed */
+    String8 vendorParams = pars.flatten();
+    if (!mLastVendorParams.isEmpty() && vendorParams == mLastVendorParams &&
+        mLastSetVersion == android_atomic_acquire_load(&mParamsVersion)) {
+        LOGV("%s: rewritten parameters unchanged, not calling the lib", __func__);
+        retval = NO_ERROR;
+    } else {
+        retval = mMotoInterface->setParameters(pars);
+        mLastVendorParams = retval == NO_ERROR ? vendorParams : String8();
+        /* invalidateParameters(), remembering the version it leads to */
+        mLastSetVersion = android_atomic_inc(&mParamsVersion) + 1;
+    }
+
+    mLastSetParams = retval == NO_ERROR ? flatParams : String8();
+    mLastSetResult = retval;
 
     if (oldFlashMode != mFlashMode) {
         toggleTorchIfNeeded();
@@ -470,8 +508,43 @@ MotoCameraWrapper::setParameters(const CameraParameters& params)
     return retval;
 }
 
+void
+MotoCameraWrapper::invalidateParameters()
+{
+    android_atomic_inc(&mParamsVersion);
+}
+
+/* called with mParamsLock held */
+void
+MotoCameraWrapper::updateParametersCache() const
+{
+    int32_t version = android_atomic_acquire_load(&mParamsVersion);
+
+    if (version != mCachedVersion) {
+        mCachedParams = buildParameters();
+        mCachedFlatParams = mCachedParams.flatten();
+        mCachedVersion = version;
+    }
+}
+
 CameraParameters
 MotoCameraWrapper::getParameters() const
+{
+    Mutex::Autolock lock(mParamsLock);
+    updateParametersCache();
+    return mCachedParams;
+}
+
+String8
+MotoCameraWrapper::getFlattenedParameters() const
+{
+    Mutex::Autolock lock(mParamsLock);
+    updateParametersCache();
+    return mCachedFlatParams;
+}
+
+CameraParameters
+MotoCameraWrapper::buildParameters() const
 {
     CameraParameters ret = mMotoInterface->getParameters();
 
@@ -528,12 +601,16 @@ MotoCameraWrapper::getParameters() const
 status_t
 MotoCameraWrapper::sendCommand(int32_t cmd, int32_t arg1, int32_t arg2)
 {
+    invalidateParameters();
     return mMotoInterface->sendCommand(cmd, arg1, arg2);
 }
 
 void
 MotoCameraWrapper::release()
 {
+    mLastSetParams.clear();
+    mLastVendorParams.clear();
+    invalidateParameters();
     mMotoInterface->release();
 }
 
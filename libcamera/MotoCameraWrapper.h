@@ -38,6 +38,7 @@ public:
     virtual status_t    dump(int fd, const Vector<String16> &args) const;
     virtual status_t    setParameters(const CameraParameters& params);
     virtual CameraParameters  getParameters() const;
+    String8             getFlattenedParameters() const;
     virtual status_t    sendCommand(int32_t command, int32_t arg1,
                                     int32_t arg2);
     virtual void        release();
@@ -90,6 +91,9 @@ private:
     static void dataCbTimestamp(nsecs_t timestamp, int32_t msgType, const sp<IMemory>& dataPtr, void* user);
     void fixUpBrokenGpsLatitudeRef(const sp<IMemory>& dataPtr);
     void toggleTorchIfNeeded();
+    CameraParameters buildParameters() const;
+    void updateParametersCache() const;
+    void invalidateParameters();
 
     sp<CameraHardwareInterface> mMotoInterface;
     sp<TorchEnableThread> mTorchThread;
@@ -97,6 +101,21 @@ private:
     bool mVideoMode;
     String8 mFlashMode;
 
+    /* Parameters as last passed in and as last sent to the lib, so that
+       repeated identical sets skip the rewriting and the lib call; only
+       valid as long as mParamsVersion is still at mLastSetVersion */
+    String8 mLastSetParams;
+    String8 mLastVendorParams;
+    status_t mLastSetResult;
+    int32_t mLastSetVersion;
+
+    /* Rewritten lib parameters, rebuilt when mParamsVersion moves on */
+    mutable Mutex mParamsLock;
+    volatile int32_t mParamsVersion;
+    mutable int32_t mCachedVersion;
+    mutable CameraParameters mCachedParams;
+    mutable String8 mCachedFlatParams;
+
     notify_callback mNotifyCb;
     data_callback mDataCb;
     data_callback_timestamp mDataCbTimestamp;
@@ -34,13 +34,22 @@
 //#define LOG_NDEBUG 0
 #define LOG_FULL_PARAMS
 //#define LOG_EACH_FRAME
+//#define CONVERSION_SELF_TEST
+//#define CONVERSION_BENCHMARK
 
 #include <hardware/camera.h>
+#include <cutils/properties.h>
 #include <camera/Overlay.h>
 #include <binder/IMemory.h>
 #include <hardware/gralloc.h>
 #include <utils/Errors.h>
+#include <utils/threads.h>
+#include <cutils/atomic.h>
 #include <vector>
+#include <algorithm>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
 
 using namespace std;
 
@@ -48,6 +57,84 @@ using namespace std;
 
 namespace android {
 
+const int kBufferCount = 6;
+
+/* Recycled client buffers of one frame size. Slots are allocated lazily
+   up to maxSlots and handed out oldest-returned first. A clear or a resize
+   starts a new generation: only buffers allocated since are recycled, the
+   older ones still out are released as they come back, so they are never
+   counted twice. */
+struct camera_memory_pool {
+    Mutex                          lock;
+    size_t                         frameSize;
+    unsigned int                   maxSlots;
+    vector<camera_memory_t*>       slots;
+    vector<camera_memory_t*>       freeSlots;
+};
+
+/* Recording frames handed to the encoder, hashed by data address so
+   release_recording_frame() finds them in constant time. Open addressing
+   with linear probing; twice the video pool size keeps the probes short. */
+#define SENT_FRAME_BITS 5
+#define SENT_FRAME_SLOTS (1 << SENT_FRAME_BITS)
+
+struct sent_frame_table {
+    Mutex                          lock;
+    camera_memory_t               *slots[SENT_FRAME_SLOTS];
+    nsecs_t                        sentTimes[SENT_FRAME_SLOTS];
+    unsigned int                   count;
+    unsigned int                   peak;
+};
+
+/* State of the recording frame drop controller, see dropPolicyCheck() */
+struct video_drop_policy {
+    Mutex                          lock;
+
+    unsigned int                   throttleThreshold;
+    unsigned int                   softThreshold;
+    unsigned int                   hardThreshold;
+    float                          dropCredit;
+
+    nsecs_t                        lastTimestamp;
+    nsecs_t                        frameInterval;
+    nsecs_t                        peakLatency;
+    nsecs_t                        windowPeakLatency;
+    unsigned int                   windowReleases;
+    nsecs_t                        avgLatency;
+    nsecs_t                        maxLatency;
+    float                          avgDepth;
+
+    unsigned int                   framesSent;
+    unsigned int                   framesReleased;
+    unsigned int                   softDrops;
+    unsigned int                   hardDrops;
+    unsigned int                   peakDepth;
+};
+
+/* Stages of the frame path timed for camera_dump(), see traceEnd() */
+enum trace_stage {
+    STAGE_DEQUEUE_BUFFER,
+    STAGE_LOCK_BUFFER,
+    STAGE_GRALLOC_LOCK,
+    STAGE_CONVERT,
+    STAGE_ENQUEUE_BUFFER,
+    STAGE_CLIENT_DATA,
+    STAGE_DATA_CALLBACK,
+    STAGE_TIMESTAMP_CALLBACK,
+    NUM_TRACE_STAGES
+};
+
+/* Two buckets per power of two microseconds, up to about half a second */
+#define TRACE_BUCKETS 40
+
+struct stage_histogram {
+    volatile int32_t               buckets[TRACE_BUCKETS];
+    volatile int32_t               count;
+    nsecs_t                        max;
+};
+
+class PreviewThread;
+
 struct legacy_camera_device {
     camera_device_t device;
     int id;
@@ -64,36 +151,277 @@ struct legacy_camera_device {
     sp<MotoCameraWrapper>          hwif;
     gralloc_module_t const        *gralloc;
     camera_memory_t*               clientData;
-    vector<camera_memory_t*>       sentFrames;
+    int32_t                        clientDataMsgType;
+    sent_frame_table               sentFrames;
+    camera_memory_pool             previewPool;
+    camera_memory_pool             videoPool;
+    video_drop_policy              dropPolicy;
     sp<Overlay>                    overlay;
+    sp<PreviewThread>              previewThread;
+    stage_histogram                stageStats[NUM_TRACE_STAGES];
 
     int32_t                        previewWidth;
     int32_t                        previewHeight;
     Overlay::Format                previewFormat;
+    int32_t                        windowFormat;
 };
 
 static long long mLastPreviewTime = 0;
 static bool mThrottlePreview = false;
-static bool mPreviousVideoFrameDropped = false;
-static int mNumVideoFramesDropped = 0;
 
 /* When the media encoder is not working fast enough,
    the number of allocated but yet unreleased frames
    in memory could start to grow without limit.
 
    Three thresholds are used to deal with such condition.
-   First, if the number of frames gets over the PREVIEW_THROTTLE_THRESHOLD,
+   First, if the number of frames gets over the throttle threshold,
    just limit the preview framerate to relieve the CPU to help the encoder
    to catch up.
-   If it is not enough and the number gets also over the SOFT_DROP_THRESHOLD,
-   start dropping new frames coming from camera, but only one at a time,
-   never two consecutive ones.
-   If the number gets even over the HARD_DROP_THRESHOLD, drop the frames
-   without further conditions. */
+   If it is not enough and the number gets also over the soft threshold,
+   start dropping new frames coming from camera, at a rate growing with
+   the distance to the hard threshold, so drops are spread out evenly.
+   If the number gets even over the hard threshold, drop the frames
+   without further conditions.
+
+   The thresholds follow the encoder: the longest release latency seen
+   recently (or the average, if higher), divided by the frame interval,
+   is the number of frames the encoder holds when it keeps up. The soft
+   threshold sits a couple of frames above that, the other two keep their
+   distance to it. The constants below are the floor; the thresholds only
+   move up from there, and MAX_HARD_DROP_THRESHOLD caps them, as it sizes
+   the video buffer pool. */
 
 const unsigned int PREVIEW_THROTTLE_THRESHOLD = 6;
 const unsigned int SOFT_DROP_THRESHOLD = 12;
 const unsigned int HARD_DROP_THRESHOLD = 15;
+const unsigned int MAX_HARD_DROP_THRESHOLD = 24;
+const unsigned int SOFT_DROP_MARGIN = 2;
+const unsigned int LATENCY_WINDOW = 30;
+/* shortest time between two preview frames while throttled, ~10 fps */
+const nsecs_t PREVIEW_THROTTLE_INTERVAL = 100000000LL;
+
+/* Client buffers kept for preview and recording frames; recording needs
+   one more than the hard drop threshold, as that many frames can be with
+   the encoder. See releaseClientData() for the preview pool size. */
+const unsigned int PREVIEW_POOL_SLOTS = 8;
+const unsigned int VIDEO_POOL_SLOTS = MAX_HARD_DROP_THRESHOLD + 1;
+
+static const char *sTraceStageNames[NUM_TRACE_STAGES] = {
+    "dequeue_buffer",
+    "lock_buffer",
+    "gralloc_lock",
+    "convert",
+    "enqueue_buffer",
+    "genClientData",
+    "data_callback",
+    "timestamp_callback",
+};
+
+static inline int traceBucket(nsecs_t duration)
+{
+    uint32_t us = duration / 1000;
+    if (us == 0) {
+        return 0;
+    }
+    int log = 31 - __builtin_clz(us);
+    int half = log > 0 ? (us >> (log - 1)) & 1 : 0;
+    return std::min(1 + 2 * log + half, TRACE_BUCKETS - 1);
+}
+
+/* upper bound of a bucket, in microseconds */
+static inline float traceBucketLimit(int bucket)
+{
+    if (bucket < 3) {
+        return bucket == 0 ? 1 : 2;
+    }
+    int log = (bucket - 1) / 2;
+    return (float) (1 << log) * (((bucket - 1) & 1) ? 2.0f : 1.5f);
+}
+
+static inline nsecs_t traceStart()
+{
+    return systemTime();
+}
+
+/* Called from the callback and preview threads concurrently, so the
+   counters are atomics; max is only informative and left unlocked. */
+static inline void traceEnd(legacy_camera_device *lcdev, trace_stage stage, nsecs_t start)
+{
+    stage_histogram *hist = &lcdev->stageStats[stage];
+    nsecs_t duration = systemTime() - start;
+
+    android_atomic_inc(&hist->buckets[traceBucket(duration)]);
+    android_atomic_inc(&hist->count);
+    if (duration > hist->max) {
+        hist->max = duration;
+    }
+}
+
+static float tracePercentile(const stage_histogram *hist, int count, int percent)
+{
+    int target = (count * percent + 99) / 100;
+    int seen = 0;
+
+    for (int i = 0; i < TRACE_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) {
+            return traceBucketLimit(i);
+        }
+    }
+    return traceBucketLimit(TRACE_BUCKETS - 1);
+}
+
+static void traceDump(legacy_camera_device *lcdev, String8& result)
+{
+    char buffer[256];
+
+    result.append("  Stage latency (us, bucket upper bounds):\n");
+    for (int i = 0; i < NUM_TRACE_STAGES; i++) {
+        const stage_histogram *hist = &lcdev->stageStats[i];
+        int count = android_atomic_acquire_load(&hist->count);
+        if (count == 0) {
+            continue;
+        }
+        snprintf(buffer, sizeof(buffer),
+                 "    %-20s n=%-8d p50 %-8.0f p95 %-8.0f p99 %-8.0f max %.0f\n",
+                 sTraceStageNames[i], count,
+                 tracePercentile(hist, count, 50), tracePercentile(hist, count, 95),
+                 tracePercentile(hist, count, 99), hist->max / 1000.0);
+        result.append(buffer);
+    }
+}
+
+static void dropPolicyReset(video_drop_policy *policy)
+{
+    Mutex::Autolock lock(policy->lock);
+
+    policy->throttleThreshold = PREVIEW_THROTTLE_THRESHOLD;
+    policy->softThreshold = SOFT_DROP_THRESHOLD;
+    policy->hardThreshold = HARD_DROP_THRESHOLD;
+    policy->dropCredit = 0;
+    policy->lastTimestamp = 0;
+    policy->frameInterval = 0;
+    policy->peakLatency = 0;
+    policy->windowPeakLatency = 0;
+    policy->windowReleases = 0;
+    policy->avgLatency = 0;
+    policy->maxLatency = 0;
+    policy->avgDepth = 0;
+    policy->framesSent = 0;
+    policy->framesReleased = 0;
+    policy->softDrops = 0;
+    policy->hardDrops = 0;
+    policy->peakDepth = 0;
+}
+
+/* called with policy->lock held */
+static void dropPolicyAdapt(video_drop_policy *policy)
+{
+    const unsigned int hardMargin = HARD_DROP_THRESHOLD - SOFT_DROP_THRESHOLD;
+    const unsigned int throttleMargin = SOFT_DROP_THRESHOLD - PREVIEW_THROTTLE_THRESHOLD;
+
+    if (policy->frameInterval <= 0 || policy->peakLatency <= 0) {
+        return;
+    }
+
+    nsecs_t latency = std::max(policy->peakLatency, policy->avgLatency);
+    unsigned int held = (latency + policy->frameInterval - 1) / policy->frameInterval;
+    unsigned int soft = held + SOFT_DROP_MARGIN;
+    soft = std::max(SOFT_DROP_THRESHOLD, std::min(soft, MAX_HARD_DROP_THRESHOLD - hardMargin));
+
+    policy->softThreshold = soft;
+    policy->hardThreshold = soft + hardMargin;
+    policy->throttleThreshold = soft - throttleMargin;
+}
+
+static void dropPolicyFrameReleased(video_drop_policy *policy, nsecs_t latency)
+{
+    Mutex::Autolock lock(policy->lock);
+
+    policy->framesReleased++;
+    policy->avgLatency = policy->avgLatency ? (policy->avgLatency * 7 + latency) / 8 : latency;
+    policy->maxLatency = std::max(policy->maxLatency, latency);
+
+    policy->windowPeakLatency = std::max(policy->windowPeakLatency, latency);
+    /* the first release takes effect right away, later windows when complete */
+    if (++policy->windowReleases >= LATENCY_WINDOW || policy->peakLatency == 0) {
+        policy->peakLatency = policy->windowPeakLatency;
+        if (policy->windowReleases >= LATENCY_WINDOW) {
+            policy->windowReleases = 0;
+            policy->windowPeakLatency = 0;
+        }
+        dropPolicyAdapt(policy);
+    }
+}
+
+/* Returns true if the frame with the given timestamp has to be dropped,
+   given the number of frames still with the encoder. */
+static bool dropPolicyCheck(video_drop_policy *policy, nsecs_t timestamp, unsigned int framesSent)
+{
+    Mutex::Autolock lock(policy->lock);
+    bool drop = false;
+
+    if (policy->lastTimestamp != 0 && timestamp > policy->lastTimestamp) {
+        nsecs_t interval = timestamp - policy->lastTimestamp;
+        policy->frameInterval = policy->frameInterval ?
+                (policy->frameInterval * 7 + interval) / 8 : interval;
+    }
+    policy->lastTimestamp = timestamp;
+    policy->avgDepth = policy->avgDepth * 0.875f + framesSent * 0.125f;
+    policy->peakDepth = std::max(policy->peakDepth, framesSent);
+
+    if (framesSent > policy->throttleThreshold) {
+        mThrottlePreview = true;
+        LOGV("%s: preview throttled (fr. queued/throttle thres.: %d/%d)",
+                    __FUNCTION__, framesSent, policy->throttleThreshold);
+    } else {
+        mThrottlePreview = false;
+    }
+
+    if (framesSent > policy->hardThreshold) {
+        policy->hardDrops++;
+        drop = true;
+    } else if (framesSent > policy->softThreshold) {
+        policy->dropCredit += (float) (framesSent - policy->softThreshold) /
+                              (policy->hardThreshold - policy->softThreshold + 1);
+        if (policy->dropCredit >= 1.0f) {
+            policy->dropCredit -= 1.0f;
+            policy->softDrops++;
+            drop = true;
+        }
+    } else {
+        policy->dropCredit = 0;
+    }
+
+    if (drop) {
+        LOGV("Frame has to be dropped! (fr. queued/soft thres./hard thres.: %d/%d/%d)",
+                framesSent, policy->softThreshold, policy->hardThreshold);
+    } else {
+        policy->framesSent++;
+    }
+    return drop;
+}
+
+static void dropPolicyDump(video_drop_policy *policy, String8& result)
+{
+    Mutex::Autolock lock(policy->lock);
+    char buffer[256];
+
+    snprintf(buffer, sizeof(buffer),
+             "  Recording: %u frames sent, %u released, %u soft drops, %u hard drops\n",
+             policy->framesSent, policy->framesReleased, policy->softDrops, policy->hardDrops);
+    result.append(buffer);
+    snprintf(buffer, sizeof(buffer),
+             "    thresholds throttle/soft/hard: %u/%u/%u, queue depth avg %.1f peak %u\n",
+             policy->throttleThreshold, policy->softThreshold, policy->hardThreshold,
+             policy->avgDepth, policy->peakDepth);
+    result.append(buffer);
+    snprintf(buffer, sizeof(buffer),
+             "    frame interval %.1f ms, encoder release latency peak %.1f avg %.1f max %.1f ms\n",
+             policy->frameInterval / 1e6, policy->peakLatency / 1e6,
+             policy->avgLatency / 1e6, policy->maxLatency / 1e6);
+    result.append(buffer);
+}
 
 /** camera_hw_device implementation **/
 static inline struct legacy_camera_device * to_lcdev(struct camera_device *dev)
@@ -187,6 +515,242 @@ static void Yuv422iToRgb565(char* rgb, char* yuv422i, int width, int height, int
     }
 }
 
+/*
+ * Table driven versions of the two converters above. The coefficient
+ * products are looked up instead of multiplied, and the clamp tables take
+ * the 18 bit intermediate already shifted down to 5/6 bits and return it
+ * in its RGB565 position, so a pixel is three lookups and two ORs.
+ * Clamping before or after the (arithmetic) shift gives the same result,
+ * so the output is identical to the C converters.
+ */
+
+#define CLAMP5_BIAS 48
+#define CLAMP6_BIAS 64
+
+static int32_t  sY1192[256];
+static int32_t  sV1634[256];
+static int32_t  sV833[256];
+static int32_t  sU400[256];
+static int32_t  sU2066[256];
+static uint16_t sClampR[128];
+static uint16_t sClampG[192];
+static uint16_t sClampB[128];
+
+static void initConversionTables()
+{
+    static bool initialized = false;
+
+    if (initialized) {
+        return;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        int y = i - 16;
+        int c = i - 128;
+        sY1192[i] = 1192 * (y < 0 ? 0 : y);
+        sV1634[i] = 1634 * c;
+        sV833[i]  = 833 * c;
+        sU400[i]  = 400 * c;
+        sU2066[i] = 2066 * c;
+    }
+    for (int i = 0; i < 128; i++) {
+        int c = std::max(0, std::min(i - CLAMP5_BIAS, 31));
+        sClampR[i] = c << 11;
+        sClampB[i] = c;
+    }
+    for (int i = 0; i < 192; i++) {
+        sClampG[i] = std::max(0, std::min(i - CLAMP6_BIAS, 63)) << 5;
+    }
+    initialized = true;
+}
+
+static inline uint16_t tableRgb565(int y1192, int rv, int guv, int bu)
+{
+    return sClampR[((y1192 + rv) >> 13) + CLAMP5_BIAS] |
+           sClampG[((y1192 - guv) >> 12) + CLAMP6_BIAS] |
+           sClampB[((y1192 + bu) >> 13) + CLAMP5_BIAS];
+}
+
+static void Yuv420spToRgb565Table(char* rgb, char* yuv420sp, int width, int height, int stride)
+{
+    const unsigned char *yuv = (const unsigned char *) yuv420sp;
+    int frameSize = width * height;
+    int rv = 0, guv = 0, bu = 0;
+
+    for (int j = 0; j < height; j++) {
+        const unsigned char *yp = yuv + j * width;
+        const unsigned char *uvp = yuv + frameSize + (j >> 1) * width;
+        uint16_t *dst = (uint16_t *) (rgb + j * stride * 2);
+
+        for (int i = 0; i < width; i++) {
+            if ((i & 1) == 0) {
+                rv  = sV1634[uvp[0]];
+                guv = sV833[uvp[0]] + sU400[uvp[1]];
+                bu  = sU2066[uvp[1]];
+                uvp += 2;
+            }
+            dst[i] = tableRgb565(sY1192[yp[i]], rv, guv, bu);
+        }
+    }
+}
+
+static void Yuv422iToRgb565Table(char* rgb, char* yuv422i, int width, int height, int stride)
+{
+    const unsigned char *src = (const unsigned char *) yuv422i;
+
+    for (int j = 0; j < height; j++) {
+        uint16_t *dst = (uint16_t *) (rgb + j * stride * 2);
+
+        for (int i = 0; i < width / 2; i++) {
+            int rv  = sV1634[src[3]];
+            int guv = sV833[src[3]] + sU400[src[1]];
+            int bu  = sU2066[src[1]];
+
+            *dst++ = tableRgb565(sY1192[src[0]], rv, guv, bu);
+            *dst++ = tableRgb565(sY1192[src[2]], rv, guv, bu);
+            src += 4;
+        }
+    }
+}
+
+#ifdef __ARM_NEON__
+/* Eight pixels of RGB565 from Y (already biased) and widened U/V.
+   vqshrun does the shift and the clamp at zero, vmin the upper clamp. */
+static inline uint16x8_t neonRgb565(uint8x8_t y, int16x8_t u, int16x8_t v)
+{
+    int16x8_t ys = vreinterpretq_s16_u16(vmovl_u8(vqsub_u8(y, vdup_n_u8(16))));
+    int32x4_t y_lo = vmull_n_s16(vget_low_s16(ys), 1192);
+    int32x4_t y_hi = vmull_n_s16(vget_high_s16(ys), 1192);
+
+    int32x4_t r_lo = vmlal_n_s16(y_lo, vget_low_s16(v), 1634);
+    int32x4_t r_hi = vmlal_n_s16(y_hi, vget_high_s16(v), 1634);
+    int32x4_t g_lo = vmlsl_n_s16(vmlsl_n_s16(y_lo, vget_low_s16(v), 833), vget_low_s16(u), 400);
+    int32x4_t g_hi = vmlsl_n_s16(vmlsl_n_s16(y_hi, vget_high_s16(v), 833), vget_high_s16(u), 400);
+    int32x4_t b_lo = vmlal_n_s16(y_lo, vget_low_s16(u), 2066);
+    int32x4_t b_hi = vmlal_n_s16(y_hi, vget_high_s16(u), 2066);
+
+    uint16x8_t r = vminq_u16(vcombine_u16(vqshrun_n_s32(r_lo, 13), vqshrun_n_s32(r_hi, 13)), vdupq_n_u16(31));
+    uint16x8_t g = vminq_u16(vcombine_u16(vqshrun_n_s32(g_lo, 12), vqshrun_n_s32(g_hi, 12)), vdupq_n_u16(63));
+    uint16x8_t b = vminq_u16(vcombine_u16(vqshrun_n_s32(b_lo, 13), vqshrun_n_s32(b_hi, 13)), vdupq_n_u16(31));
+
+    return vorrq_u16(vorrq_u16(vshlq_n_u16(r, 11), vshlq_n_u16(g, 5)), b);
+}
+
+static inline int16x8_t neonChroma(uint8x8_t c)
+{
+    return vreinterpretq_s16_u16(vsubl_u8(c, vdup_n_u8(128)));
+}
+
+static void Yuv420spToRgb565Neon(char* rgb, char* yuv420sp, int width, int height, int stride)
+{
+    const unsigned char *yuv = (const unsigned char *) yuv420sp;
+    int frameSize = width * height;
+
+    for (int j = 0; j < height; j++) {
+        const unsigned char *yp = yuv + j * width;
+        const unsigned char *uvp = yuv + frameSize + (j >> 1) * width;
+        uint16_t *dst = (uint16_t *) (rgb + j * stride * 2);
+        int i = 0;
+
+        /* 16 pixels share 8 VU pairs, each pair is used twice */
+        for (; i + 16 <= width; i += 16) {
+            uint8x16_t y = vld1q_u8(yp + i);
+            uint8x8x2_t vu = vld2_u8(uvp);
+            uint8x8x2_t v = vzip_u8(vu.val[0], vu.val[0]);
+            uint8x8x2_t u = vzip_u8(vu.val[1], vu.val[1]);
+
+            vst1q_u16(dst + i, neonRgb565(vget_low_u8(y), neonChroma(u.val[0]), neonChroma(v.val[0])));
+            vst1q_u16(dst + i + 8, neonRgb565(vget_high_u8(y), neonChroma(u.val[1]), neonChroma(v.val[1])));
+            uvp += 16;
+        }
+
+        int rv = 0, guv = 0, bu = 0;
+        for (; i < width; i++) {
+            if ((i & 1) == 0) {
+                rv  = sV1634[uvp[0]];
+                guv = sV833[uvp[0]] + sU400[uvp[1]];
+                bu  = sU2066[uvp[1]];
+                uvp += 2;
+            }
+            dst[i] = tableRgb565(sY1192[yp[i]], rv, guv, bu);
+        }
+    }
+}
+
+static void Yuv422iToRgb565Neon(char* rgb, char* yuv422i, int width, int height, int stride)
+{
+    const unsigned char *src = (const unsigned char *) yuv422i;
+    int pairs = width / 2;
+
+    for (int j = 0; j < height; j++) {
+        uint16_t *dst = (uint16_t *) (rgb + j * stride * 2);
+        int i = 0;
+
+        /* even and odd pixels share U/V, vst2 interleaves them back */
+        for (; i + 8 <= pairs; i += 8) {
+            uint8x8x4_t yuyv = vld4_u8(src);
+            int16x8_t u = neonChroma(yuyv.val[1]);
+            int16x8_t v = neonChroma(yuyv.val[3]);
+            uint16x8x2_t out;
+
+            out.val[0] = neonRgb565(yuyv.val[0], u, v);
+            out.val[1] = neonRgb565(yuyv.val[2], u, v);
+            vst2q_u16(dst, out);
+            dst += 16;
+            src += 32;
+        }
+
+        for (; i < pairs; i++) {
+            int rv  = sV1634[src[3]];
+            int guv = sV833[src[3]] + sU400[src[1]];
+            int bu  = sU2066[src[1]];
+
+            *dst++ = tableRgb565(sY1192[src[0]], rv, guv, bu);
+            *dst++ = tableRgb565(sY1192[src[2]], rv, guv, bu);
+            src += 4;
+        }
+    }
+}
+#endif
+
+typedef void (*Rgb565ConvertFunc)(char* rgb, char* yuv, int width, int height, int stride);
+
+struct Rgb565Kernel {
+    const char        *name;
+    Rgb565ConvertFunc  fromYuv420sp;
+    Rgb565ConvertFunc  fromYuv422i;
+};
+
+/* Last entry is the default; ro.camera.rgb565.kernel picks one by name */
+static const Rgb565Kernel sRgb565Kernels[] = {
+    { "c",     Yuv420spToRgb565,      Yuv422iToRgb565 },
+    { "table", Yuv420spToRgb565Table, Yuv422iToRgb565Table },
+#ifdef __ARM_NEON__
+    { "neon",  Yuv420spToRgb565Neon,  Yuv422iToRgb565Neon },
+#endif
+};
+
+#define NUM_RGB565_KERNELS (sizeof(sRgb565Kernels) / sizeof(sRgb565Kernels[0]))
+
+static const Rgb565Kernel *sRgb565Kernel = &sRgb565Kernels[NUM_RGB565_KERNELS - 1];
+
+static void selectRgb565Kernel()
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    initConversionTables();
+
+    if (property_get("ro.camera.rgb565.kernel", value, NULL) > 0) {
+        for (size_t i = 0; i < NUM_RGB565_KERNELS; i++) {
+            if (strcmp(value, sRgb565Kernels[i].name) == 0) {
+                sRgb565Kernel = &sRgb565Kernels[i];
+                break;
+            }
+        }
+    }
+    LOGD("%s: using %s RGB565 converter", __FUNCTION__, sRgb565Kernel->name);
+}
+
 static void Yuv422iToYV12 (unsigned char* dest, unsigned char* src, int width, int height, int stride) 
 {
     int i, j;
@@ -221,6 +785,217 @@ static void Yuv422iToYV12 (unsigned char* dest, unsigned char* src, int width, i
     }
 }
 
+#ifdef __ARM_NEON__
+/* Same output as Yuv422iToYV12, 16 macropixels (32 pixels) per iteration.
+   vld4 splits YUYV into Y0/U/Y1/V lanes, vhadd gives the truncated average
+   used by the C version, so the result is bit-exact. */
+static void Yuv422iToYV12Neon(unsigned char* dest, unsigned char* src, int width, int height, int stride)
+{
+    int i, j;
+    int pairs = (width + 1) / 2;
+    int total = pairs * height;
+    unsigned char *src1;
+    unsigned char *udest, *vdest;
+
+    /* copy the Y values; rows are contiguous so treat it as one stream */
+    src1 = src;
+    for (j = 0; j + 16 <= total; j += 16) {
+        uint8x16x4_t yuyv = vld4q_u8(src1);
+        uint8x16x2_t y;
+        y.val[0] = yuyv.val[0];
+        y.val[1] = yuyv.val[2];
+        vst2q_u8(dest, y);
+        dest += 32;
+        src1 += 64;
+    }
+    for (; j < total; j++) {
+        *dest++ = src1[0];
+        *dest++ = src1[2];
+        src1 += 4;
+    }
+
+    /* copy the U and V values */
+    src1 = src + width * 2;
+
+    vdest = dest;
+    udest = dest + width * height / 4;
+
+    for (i = 0; i < height; i += 2) {
+        for (j = 0; j + 16 <= pairs; j += 16) {
+            uint8x16x4_t row0 = vld4q_u8(src);
+            uint8x16x4_t row1 = vld4q_u8(src1);
+            vst1q_u8(udest, vhaddq_u8(row0.val[1], row1.val[1]));
+            vst1q_u8(vdest, vhaddq_u8(row0.val[3], row1.val[3]));
+            udest += 16;
+            vdest += 16;
+            src += 64;
+            src1 += 64;
+        }
+        for (; j < pairs; j++) {
+            *udest++ = ((int) src[1] + src1[1]) / 2;
+            *vdest++ = ((int) src[3] + src1[3]) / 2;
+            src += 4;
+            src1 += 4;
+        }
+        src = src1;
+        src1 += width * 2;
+    }
+}
+#endif
+
+static void (*sYuv422iToYV12)(unsigned char*, unsigned char*, int, int, int) =
+#ifdef __ARM_NEON__
+    Yuv422iToYV12Neon;
+#else
+    Yuv422iToYV12;
+#endif
+
+#ifdef CONVERSION_SELF_TEST
+/* Compare the selected YV12 converter against the C reference over a few
+   awkward geometries; falls back to the C version on any mismatch. */
+static void selfTestYuv422iToYV12()
+{
+    static const int sizes[][3] = {
+        /* width, height, stride */
+        { 848, 480, 848 }, { 640, 480, 672 }, { 176, 144, 192 },
+        { 34, 6, 48 }, { 31, 5, 32 }, { 17, 3, 17 }, { 2, 2, 16 },
+    };
+
+    if (sYuv422iToYV12 == Yuv422iToYV12) {
+        return;
+    }
+
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+        int w = sizes[n][0], h = sizes[n][1], stride = sizes[n][2];
+        /* the C version reads one row past odd heights, pad for it */
+        size_t inSize = (size_t) ((w + 1) / 2) * 4 * (h + 1) + 64;
+        size_t outSize = (size_t) ((w + 1) & ~1) * h * 2 + 64;
+        vector<unsigned char> in(inSize), ref(outSize, 0), out(outSize, 0);
+
+        for (size_t k = 0; k < inSize; k++) {
+            in[k] = (unsigned char) ((k * 1103515245u + 12345u) >> 16);
+        }
+
+        Yuv422iToYV12(&ref[0], &in[0], w, h, stride);
+        sYuv422iToYV12(&out[0], &in[0], w, h, stride);
+
+        if (ref != out) {
+            LOGE("%s: mismatch at %dx%d stride %d, using C converter", __FUNCTION__, w, h, stride);
+            sYuv422iToYV12 = Yuv422iToYV12;
+            return;
+        }
+    }
+    LOGI("%s: passed", __FUNCTION__);
+}
+
+/* Check every RGB565 kernel against the C converters. */
+static void selfTestRgb565()
+{
+    static const int sizes[][3] = {
+        /* width, height, stride */
+        { 848, 480, 848 }, { 640, 480, 672 }, { 176, 144, 192 },
+        { 34, 6, 48 }, { 30, 4, 33 }, { 18, 2, 18 }, { 2, 2, 16 },
+    };
+
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+        int w = sizes[n][0], h = sizes[n][1], stride = sizes[n][2];
+        size_t inSize = (size_t) w * h * 2;
+        size_t outSize = (size_t) stride * h * 2;
+        vector<char> in(inSize), ref(outSize, 0), out(outSize, 0);
+
+        for (size_t k = 0; k < inSize; k++) {
+            in[k] = (char) ((k * 1103515245u + 12345u) >> 16);
+        }
+
+        for (size_t i = 1; i < NUM_RGB565_KERNELS; i++) {
+            const Rgb565Kernel *kernel = &sRgb565Kernels[i];
+
+            Yuv420spToRgb565(&ref[0], &in[0], w, h, stride);
+            kernel->fromYuv420sp(&out[0], &in[0], w, h, stride);
+            if (ref != out) {
+                LOGE("%s: %s YUV420SP mismatch at %dx%d stride %d", __FUNCTION__, kernel->name, w, h, stride);
+            }
+
+            Yuv422iToRgb565(&ref[0], &in[0], w, h, stride);
+            kernel->fromYuv422i(&out[0], &in[0], w, h, stride);
+            if (ref != out) {
+                LOGE("%s: %s YUV422I mismatch at %dx%d stride %d", __FUNCTION__, kernel->name, w, h, stride);
+            }
+        }
+    }
+}
+#endif
+
+#ifdef CONVERSION_BENCHMARK
+/* Log the throughput of every preview converter on a WVGA frame. */
+static void benchmarkConverters()
+{
+    const int w = 848, h = 480, iterations = 50;
+    vector<char> in(w * h * 2), out(w * h * 2);
+
+    for (size_t k = 0; k < in.size(); k++) {
+        in[k] = (char) ((k * 1103515245u + 12345u) >> 16);
+    }
+
+    for (size_t i = 0; i < NUM_RGB565_KERNELS; i++) {
+        const Rgb565Kernel *kernel = &sRgb565Kernels[i];
+        nsecs_t start = systemTime();
+        for (int n = 0; n < iterations; n++) {
+            kernel->fromYuv420sp(&out[0], &in[0], w, h, w);
+        }
+        nsecs_t mid = systemTime();
+        for (int n = 0; n < iterations; n++) {
+            kernel->fromYuv422i(&out[0], &in[0], w, h, w);
+        }
+        nsecs_t end = systemTime();
+
+        LOGI("%s: rgb565/%s: yuv420sp %.1f Mpixel/s, yuv422i %.1f Mpixel/s", __FUNCTION__, kernel->name,
+             (double) w * h * iterations * 1000.0 / (mid - start),
+             (double) w * h * iterations * 1000.0 / (end - mid));
+    }
+
+    nsecs_t start = systemTime();
+    for (int n = 0; n < iterations; n++) {
+        Yuv422iToYV12((unsigned char*) &out[0], (unsigned char*) &in[0], w, h, w);
+    }
+    nsecs_t mid = systemTime();
+    for (int n = 0; n < iterations; n++) {
+        sYuv422iToYV12((unsigned char*) &out[0], (unsigned char*) &in[0], w, h, w);
+    }
+    nsecs_t end = systemTime();
+
+    LOGI("%s: yv12: c %.1f Mpixel/s, selected %.1f Mpixel/s", __FUNCTION__,
+         (double) w * h * iterations * 1000.0 / (mid - start),
+         (double) w * h * iterations * 1000.0 / (end - mid));
+}
+#endif
+
+static void *lockPreviewBuffer(legacy_camera_device *lcdev, buffer_handle_t *bufHandle)
+{
+    int ret;
+    int tries = 5;
+    void *vaddr;
+
+    do {
+        ret = lcdev->gralloc->lock(lcdev->gralloc, *bufHandle,
+                                    GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_RENDER,
+                                   0, 0, lcdev->previewWidth, lcdev->previewHeight, &vaddr);
+        tries--;
+        if (ret) {
+            LOGW("%s: gralloc lock retry", __FUNCTION__);
+
+            usleep(1000);
+        }
+    } while (ret && tries > 0);
+
+    return ret ? NULL : vaddr;
+}
+
+static void unlockPreviewBuffer(legacy_camera_device *lcdev, buffer_handle_t *bufHandle)
+{
+    lcdev->gralloc->unlock(lcdev->gralloc, *bufHandle);
+}
+
 static void processPreviewData(char *frame, size_t size, legacy_camera_device *lcdev, Overlay::Format format)
 {
 #ifdef LOG_EACH_FRAME
@@ -232,7 +1007,9 @@ static void processPreviewData(char *frame, size_t size, legacy_camera_device *l
 
     int32_t stride;
     buffer_handle_t *bufHandle = NULL;
+    nsecs_t start = traceStart();
     int ret = lcdev->window->dequeue_buffer(lcdev->window, &bufHandle, &stride);
+    traceEnd(lcdev, STAGE_DEQUEUE_BUFFER, start);
 
     if (ret != NO_ERROR) {
         LOGE("%s: ERROR dequeueing the buffer\n", __FUNCTION__);
@@ -243,59 +1020,401 @@ static void processPreviewData(char *frame, size_t size, legacy_camera_device *l
         LOGE("%s: stride=%d doesn't equal width=%d", __FUNCTION__, stride, lcdev->previewWidth);
     }
 
+    start = traceStart();
     ret = lcdev->window->lock_buffer(lcdev->window, bufHandle);
+    traceEnd(lcdev, STAGE_LOCK_BUFFER, start);
     if (ret != NO_ERROR) {
         LOGE("%s: ERROR locking the buffer\n", __FUNCTION__);
         lcdev->window->cancel_buffer(lcdev->window, bufHandle);
         return;
     }
 
-    int tries = 5;
-    void *vaddr;
-
-    do {
-        ret = lcdev->gralloc->lock(lcdev->gralloc, *bufHandle,
-                                    GRALLOC_USAGE_SW_WRITE_OFTEN | GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_RENDER,
-                                   0, 0, lcdev->previewWidth, lcdev->previewHeight, &vaddr);
-        tries--;
-        if (ret) {
-            LOGW("%s: gralloc lock retry", __FUNCTION__);
+    start = traceStart();
+    void *vaddr = lockPreviewBuffer(lcdev, bufHandle);
+    traceEnd(lcdev, STAGE_GRALLOC_LOCK, start);
 
-            usleep(1000);
-        }
-    } while (ret && tries > 0);
-
-    if (ret) {
+    if (vaddr == NULL) {
         LOGE("%s: could not lock gralloc buffer", __FUNCTION__);
     } else {
-        // The data we get is in YUV... but Window is RGB565. It needs to be converted
-        switch (format) {
-            case Overlay::FORMAT_YUV422I:
-                Yuv422iToYV12((unsigned char*)vaddr, (unsigned char*)frame, lcdev->previewWidth, lcdev->previewHeight, stride);
-                break;
-            case Overlay::FORMAT_YUV420SP:
-                memcpy(vaddr, frame, lcdev->previewWidth * lcdev->previewHeight * 1.5);
-                break;
-            default:
-                LOGE("%s: Unknown video format, cannot convert!", __FUNCTION__);
+        start = traceStart();
+        // The data we get is in YUV... but Window is YV12 or RGB565. It needs to be converted
+        if (lcdev->windowFormat == HAL_PIXEL_FORMAT_RGB_565) {
+            switch (format) {
+                case Overlay::FORMAT_YUV422I:
+                    sRgb565Kernel->fromYuv422i((char*)vaddr, frame, lcdev->previewWidth, lcdev->previewHeight, stride);
+                    break;
+                case Overlay::FORMAT_YUV420SP:
+                    sRgb565Kernel->fromYuv420sp((char*)vaddr, frame, lcdev->previewWidth, lcdev->previewHeight, stride);
+                    break;
+                default:
+                    LOGE("%s: Unknown video format, cannot convert!", __FUNCTION__);
+            }
+        } else {
+            switch (format) {
+                case Overlay::FORMAT_YUV422I:
+                    sYuv422iToYV12((unsigned char*)vaddr, (unsigned char*)frame, lcdev->previewWidth, lcdev->previewHeight, stride);
+                    break;
+                case Overlay::FORMAT_YUV420SP:
+                    memcpy(vaddr, frame, lcdev->previewWidth * lcdev->previewHeight * 1.5);
+                    break;
+                default:
+                    LOGE("%s: Unknown video format, cannot convert!", __FUNCTION__);
+            }
         }
-        lcdev->gralloc->unlock(lcdev->gralloc, *bufHandle);
+        traceEnd(lcdev, STAGE_CONVERT, start);
+        unlockPreviewBuffer(lcdev, bufHandle);
     }
 
+    start = traceStart();
     if (lcdev->window->enqueue_buffer(lcdev->window, bufHandle) != 0) {
         LOGE("%s: could not enqueue gralloc buffer", __FUNCTION__);
     }
+    traceEnd(lcdev, STAGE_ENQUEUE_BUFFER, start);
+}
+
+/*
+ * Preview conversion worker (ro.camera.preview.async). The vendor callback
+ * puts a reference to its frame into a short ring owned by this thread and
+ * returns; dequeue, gralloc lock, conversion and enqueue run here. Nothing
+ * is copied: the vendor gives its preview buffer back to the driver when
+ * the callback returns, but the driver cycles through several before it
+ * fills that one again. With at most PREVIEW_QUEUE_SIZE frames referenced
+ * and frames older than PREVIEW_MAX_AGE dropped unconverted, the worker is
+ * done with a buffer before it is rewritten. When the ring is full the new
+ * frame is dropped instead of stalling the sensor pipeline.
+ *
+ * pause() empties the ring and waits for the frame in progress, so the
+ * window and the preview geometry can change under it; frames coming in
+ * until resume() are dropped. The thread starts paused.
+ */
+#define PREVIEW_QUEUE_SIZE 2
+#define PREVIEW_MAX_AGE 50000000LL
+
+class PreviewThread : public Thread {
+public:
+    PreviewThread(legacy_camera_device *lcdev) :
+        Thread(false), mDev(lcdev), mHead(0), mTail(0), mBusy(false), mPaused(true),
+        mQueued(0), mDropped(0), mProcessed(0),
+        mWaitSum(0), mWaitMax(0), mProcessSum(0), mProcessMax(0)
+    {
+    }
+
+    /* producer side, vendor callback thread; memory, if set, keeps the
+       heap the frame lives in around until the frame is converted */
+    bool queueFrame(const char *frame, size_t size, Overlay::Format format,
+                    const sp<IMemory>& memory)
+    {
+        Mutex::Autolock lock(mLock);
+
+        /* the slot being converted is not free yet */
+        if (mPaused || mHead - mTail + (mBusy ? 1 : 0) >= PREVIEW_QUEUE_SIZE) {
+            android_atomic_inc(&mDropped);
+            return false;
+        }
+
+        Entry *entry = &mQueue[mHead % PREVIEW_QUEUE_SIZE];
+        entry->data = frame;
+        entry->size = size;
+        entry->memory = memory;
+        entry->format = format;
+        entry->queued = systemTime();
+
+        mHead++;
+        android_atomic_inc(&mQueued);
+        mCond.signal();
+        return true;
+    }
+
+    /* drop the queued frames and wait until nothing touches the window */
+    void pause()
+    {
+        Mutex::Autolock lock(mLock);
+
+        mPaused = true;
+        android_atomic_add(mHead - mTail, &mDropped);
+        for (; mTail != mHead; mTail++) {
+            mQueue[mTail % PREVIEW_QUEUE_SIZE].memory.clear();
+        }
+        while (mBusy) {
+            mIdle.wait(mLock);
+        }
+    }
+
+    void resume()
+    {
+        Mutex::Autolock lock(mLock);
+        mPaused = false;
+    }
+
+    void stop()
+    {
+        {
+            Mutex::Autolock lock(mLock);
+            requestExit();
+            mCond.signal();
+        }
+        requestExitAndWait();
+    }
+
+    void dump(String8& result) const
+    {
+        char buffer[256];
+        unsigned int processed;
+        nsecs_t waitSum, waitMax, processSum, processMax;
+
+        {
+            Mutex::Autolock lock(mLock);
+            processed = mProcessed ? mProcessed : 1;
+            waitSum = mWaitSum;
+            waitMax = mWaitMax;
+            processSum = mProcessSum;
+            processMax = mProcessMax;
+        }
+
+        snprintf(buffer, sizeof(buffer),
+                 "  Preview pipeline: %d queued, %d dropped, queue wait avg %.2f max %.2f ms, "
+                 "processing avg %.2f max %.2f ms\n",
+                 android_atomic_acquire_load(&mQueued), android_atomic_acquire_load(&mDropped),
+                 waitSum / processed / 1e6, waitMax / 1e6,
+                 processSum / processed / 1e6, processMax / 1e6);
+        result.append(buffer);
+    }
+
+private:
+    struct Entry {
+        const char        *data;
+        size_t             size;
+        sp<IMemory>        memory;
+        Overlay::Format    format;
+        nsecs_t            queued;
+    };
+
+    virtual bool threadLoop()
+    {
+        Entry *entry;
+
+        {
+            Mutex::Autolock lock(mLock);
+            while (!exitPending() && (mPaused || mHead == mTail)) {
+                mCond.wait(mLock);
+            }
+            if (exitPending()) {
+                return false;
+            }
+            entry = &mQueue[mTail % PREVIEW_QUEUE_SIZE];
+            mTail++;
+            mBusy = true;
+        }
+
+        nsecs_t start = systemTime();
+
+        /* the driver may be filling the buffer again by now */
+        bool stale = start - entry->queued > PREVIEW_MAX_AGE;
+        if (!stale) {
+            processPreviewData((char*) entry->data, entry->size, mDev, entry->format);
+        }
+
+        nsecs_t end = systemTime();
+
+        Mutex::Autolock lock(mLock);
+        entry->memory.clear();
+        if (stale) {
+            android_atomic_inc(&mDropped);
+            mBusy = false;
+            mIdle.broadcast();
+            return true;
+        }
+        mWaitSum += start - entry->queued;
+        mWaitMax = std::max(mWaitMax, start - entry->queued);
+        mProcessSum += end - start;
+        mProcessMax = std::max(mProcessMax, end - start);
+        mProcessed++;
+        mBusy = false;
+        mIdle.broadcast();
+        return true;
+    }
+
+    legacy_camera_device *mDev;
+    Entry mQueue[PREVIEW_QUEUE_SIZE];
+    mutable Mutex mLock;
+    Condition mCond;
+    Condition mIdle;
+    unsigned int mHead;
+    unsigned int mTail;
+    bool mBusy;
+    bool mPaused;
+
+    volatile int32_t mQueued;
+    volatile int32_t mDropped;
+    unsigned int mProcessed;
+    nsecs_t mWaitSum;
+    nsecs_t mWaitMax;
+    nsecs_t mProcessSum;
+    nsecs_t mProcessMax;
+};
+
+static void pausePreviewThread(legacy_camera_device *lcdev)
+{
+    if (lcdev->previewThread != NULL) {
+        lcdev->previewThread->pause();
+    }
+}
+
+static void resumePreviewThread(legacy_camera_device *lcdev)
+{
+    if (lcdev->previewThread != NULL) {
+        lcdev->previewThread->resume();
+    }
+}
+
+/* Hands a frame to the window, directly or through the worker. While the
+   recording drop controller throttles the preview (see dropPolicyCheck()),
+   frames closer than PREVIEW_THROTTLE_INTERVAL to the last one shown are
+   skipped, leaving the CPU to the encoder. */
+static void renderPreviewFrame(legacy_camera_device *lcdev, char *frame, size_t size,
+                               Overlay::Format format, const sp<IMemory>& memory)
+{
+    if (mThrottlePreview) {
+        nsecs_t now = systemTime();
+        if (now - mLastPreviewTime < PREVIEW_THROTTLE_INTERVAL) {
+            return;
+        }
+        mLastPreviewTime = now;
+    }
+
+    if (lcdev->previewThread != NULL) {
+        lcdev->previewThread->queueFrame(frame, size, format, memory);
+    } else {
+        processPreviewData(frame, size, lcdev, format);
+    }
 }
 
 static void overlayQueueBuffer(void *data, void *buffer, size_t size) {
         if (data != NULL && buffer != NULL) {
             legacy_camera_device *lcdev = (legacy_camera_device *) data;
             Overlay::Format format = (Overlay::Format) lcdev->overlay->getFormat();
-            processPreviewData((char*)buffer, size, lcdev, format);
+            renderPreviewFrame(lcdev, (char*)buffer, size, format, NULL);
+        }
+}
+
+/* called with pool->lock held */
+static void poolNewGeneration(camera_memory_pool *pool, size_t size)
+{
+    vector<camera_memory_t*>::iterator it;
+    for (it = pool->freeSlots.begin(); it != pool->freeSlots.end(); ++it) {
+        (*it)->release(*it);
+    }
+    pool->freeSlots.clear();
+    pool->slots.clear();
+    pool->frameSize = size;
+}
+
+static void poolClear(camera_memory_pool *pool)
+{
+    Mutex::Autolock lock(pool->lock);
+    poolNewGeneration(pool, 0);
+}
+
+static camera_memory_t* poolGet(legacy_camera_device *lcdev, camera_memory_pool *pool, size_t size)
+{
+    Mutex::Autolock lock(pool->lock);
+    camera_memory_t *mem = NULL;
+
+    if (size != pool->frameSize) {
+        LOGD("%s: frame size %u -> %u, rebuilding pool", __FUNCTION__, pool->frameSize, size);
+        poolNewGeneration(pool, size);
+    }
+
+    if (!pool->freeSlots.empty()) {
+        mem = pool->freeSlots.front();
+        pool->freeSlots.erase(pool->freeSlots.begin());
+    } else if (pool->slots.size() < pool->maxSlots) {
+        mem = lcdev->request_memory(-1, size, 1, lcdev->user);
+        if (mem != NULL) {
+            pool->slots.push_back(mem);
         }
+    }
+    return mem;
+}
+
+static void poolPut(camera_memory_pool *pool, camera_memory_t *mem)
+{
+    Mutex::Autolock lock(pool->lock);
+    /* at most maxSlots to look through */
+    if (find(pool->slots.begin(), pool->slots.end(), mem) != pool->slots.end()) {
+        pool->freeSlots.push_back(mem);
+    } else {
+        mem->release(mem);
+    }
+}
+
+static inline unsigned int sentFrameHash(const void *data)
+{
+    /* client buffers are page aligned, the low bits carry nothing */
+    return ((uint32_t) ((uintptr_t) data >> 12) * 2654435761u) >> (32 - SENT_FRAME_BITS);
+}
+
+static bool sentFrameAdd(sent_frame_table *table, camera_memory_t *mem)
+{
+    Mutex::Autolock lock(table->lock);
+
+    if (table->count >= SENT_FRAME_SLOTS - 1) {
+        return false;
+    }
+
+    unsigned int i = sentFrameHash(mem->data);
+    while (table->slots[i] != NULL) {
+        i = (i + 1) & (SENT_FRAME_SLOTS - 1);
+    }
+    table->slots[i] = mem;
+    table->sentTimes[i] = systemTime();
+    table->count++;
+    if (table->count > table->peak) {
+        table->peak = table->count;
+    }
+    return true;
+}
+
+static camera_memory_t* sentFrameRemove(sent_frame_table *table, const void *data, nsecs_t *sentTime)
+{
+    Mutex::Autolock lock(table->lock);
+    unsigned int i = sentFrameHash(data);
+
+    while (table->slots[i] != NULL && table->slots[i]->data != data) {
+        i = (i + 1) & (SENT_FRAME_SLOTS - 1);
+    }
+
+    camera_memory_t *mem = table->slots[i];
+    if (mem == NULL) {
+        return NULL;
+    }
+    *sentTime = table->sentTimes[i];
+
+    /* backward shift deletion, so no tombstones are needed */
+    unsigned int hole = i;
+    for (unsigned int j = (i + 1) & (SENT_FRAME_SLOTS - 1);
+         table->slots[j] != NULL; j = (j + 1) & (SENT_FRAME_SLOTS - 1)) {
+        unsigned int home = sentFrameHash(table->slots[j]->data);
+        /* move the entry into the hole unless its home lies in (hole, j] */
+        if (((j - home) & (SENT_FRAME_SLOTS - 1)) >= ((j - hole) & (SENT_FRAME_SLOTS - 1))) {
+            table->slots[hole] = table->slots[j];
+            table->sentTimes[hole] = table->sentTimes[j];
+            hole = j;
+        }
+    }
+    table->slots[hole] = NULL;
+    table->count--;
+    return mem;
+}
+
+static inline unsigned int sentFrameCount(sent_frame_table *table)
+{
+    Mutex::Autolock lock(table->lock);
+    return table->count;
 }
 
 static camera_memory_t* genClientData(legacy_camera_device *lcdev,
+                                      camera_memory_pool *pool,
                                       const sp<IMemory> &dataPtr)
 {
     ssize_t          offset;
@@ -306,7 +1425,11 @@ static camera_memory_t* genClientData(legacy_camera_device *lcdev,
     LOGV("genClientData: offset:%#x size:%#x base:%p\n",
           (unsigned)offset, size, mHeap != NULL ? mHeap->base() : 0);
 
-    clientData = lcdev->request_memory(-1, size, 1, lcdev->user);
+    if (pool != NULL) {
+        clientData = poolGet(lcdev, pool, size);
+    } else {
+        clientData = lcdev->request_memory(-1, size, 1, lcdev->user);
+    }
     if (clientData != NULL) {
         LOGV("%s: clientData=%p clientData->data=%p", __FUNCTION__, clientData, clientData->data);
         memcpy(clientData->data, (char *)(mHeap->base()) + offset, size);
@@ -316,6 +1439,28 @@ static camera_memory_t* genClientData(legacy_camera_device *lcdev,
     return clientData;
 }
 
+/* Only preview frames are recycled: still capture data is delivered to
+   the app asynchronously and may still be in use after the callback.
+
+   Preview frames are posted oneway too and, with the camcorder callback
+   flags, not copied out, so the app may read a buffer well after the
+   callback returned. The buffer of the last frame is therefore only given
+   back once the next one has been posted, and the pool hands out the
+   oldest returned buffer first: a buffer is written again no earlier than
+   PREVIEW_POOL_SLOTS frames after it was posted, about a quarter of a
+   second at 30 fps, which covers the app's callback latency. */
+static void releaseClientData(legacy_camera_device *lcdev, camera_memory_t *mem, int32_t msgType)
+{
+    if (mem == NULL) {
+        return;
+    }
+    if (msgType == CAMERA_MSG_PREVIEW_FRAME) {
+        poolPut(&lcdev->previewPool, mem);
+    } else {
+        mem->release(mem);
+    }
+}
+
 static void dataCallback(int32_t msgType, const sp<IMemory>& dataPtr, void* user)
 {
     struct legacy_camera_device *lcdev = (struct legacy_camera_device *) user;
@@ -323,14 +1468,20 @@ static void dataCallback(int32_t msgType, const sp<IMemory>& dataPtr, void* user
     LOGV("CameraHAL_DataCb: msg_type:%d user:%p\n", msg_type, user);
 
     if (lcdev->data_callback != NULL && lcdev->request_memory != NULL) {
-        if (lcdev->clientData != NULL) {
-            lcdev->clientData->release(lcdev->clientData);
-        }
-        lcdev->clientData = genClientData(lcdev, dataPtr);
+        camera_memory_t *previous = lcdev->clientData;
+        int32_t previousMsgType = lcdev->clientDataMsgType;
+        nsecs_t start = traceStart();
+        lcdev->clientData = genClientData(lcdev,
+                msgType == CAMERA_MSG_PREVIEW_FRAME ? &lcdev->previewPool : NULL, dataPtr);
+        lcdev->clientDataMsgType = msgType;
+        traceEnd(lcdev, STAGE_CLIENT_DATA, start);
         if (lcdev->clientData != NULL) {
             LOGV("%s: Posting data to client\n", __FUNCTION__);
+            start = traceStart();
             lcdev->data_callback(msgType, lcdev->clientData, 0, NULL, lcdev->user);
+            traceEnd(lcdev, STAGE_DATA_CALLBACK, start);
         }
+        releaseClientData(lcdev, previous, previousMsgType);
     }
 
     if (msgType == CAMERA_MSG_PREVIEW_FRAME && lcdev->overlay == NULL) {
@@ -339,7 +1490,7 @@ static void dataCallback(int32_t msgType, const sp<IMemory>& dataPtr, void* user
         sp<IMemoryHeap> mHeap = dataPtr->getMemory(&offset, &size);
         char* buffer = (char*) mHeap->getBase() + offset;
         LOGV("CameraHAL_DataCb: preview size = %dx%d\n", lcdev->previewWidth, lcdev->previewHeight);
-        processPreviewData(buffer, size, lcdev, lcdev->previewFormat);
+        renderPreviewFrame(lcdev, buffer, size, lcdev->previewFormat, dataPtr);
     }
 }
 
@@ -349,37 +1500,42 @@ static void dataTimestampCallback(nsecs_t timestamp, int32_t msgType, const sp<I
 
     LOGV("%s: timestamp:%lld msg_type:%d user:%p",
             __FUNCTION__, timestamp /1000, msgType, user);
-    unsigned int framesSent = lcdev->sentFrames.size();
-    if (framesSent > PREVIEW_THROTTLE_THRESHOLD) {
-        mThrottlePreview = true;
-        LOGV("%s: preview throttled (fr. queued/throttle thres.: %d/%d)",
-                    __FUNCTION__, framesSent, PREVIEW_THROTTLE_THRESHOLD);
-        if ((!mPreviousVideoFrameDropped && framesSent > SOFT_DROP_THRESHOLD)
-                || framesSent > HARD_DROP_THRESHOLD) {
-            LOGV("Frame has to be dropped! (fr. queued/soft thres./hard thres.: %d/%d/%d)",
-                    framesSent, SOFT_DROP_THRESHOLD, HARD_DROP_THRESHOLD);
-            mPreviousVideoFrameDropped = true;
-            mNumVideoFramesDropped++;
-            lcdev->hwif->releaseRecordingFrame(dataPtr);
-            return;
-        }
-    } else {
-        mThrottlePreview = false;
+    unsigned int framesSent = sentFrameCount(&lcdev->sentFrames);
+    if (dropPolicyCheck(&lcdev->dropPolicy, timestamp, framesSent)) {
+        lcdev->hwif->releaseRecordingFrame(dataPtr);
+        return;
     }
 
     if (lcdev->data_timestamp_callback != NULL && lcdev->request_memory != NULL) {
-        camera_memory_t *mem = genClientData(lcdev, dataPtr);
+        nsecs_t start = traceStart();
+        camera_memory_t *mem = genClientData(lcdev, &lcdev->videoPool, dataPtr);
+        traceEnd(lcdev, STAGE_CLIENT_DATA, start);
         if (mem != NULL) {
 
+            if (!sentFrameAdd(&lcdev->sentFrames, mem)) {
+                LOGE("%s: too many frames with the encoder, dropping", __FUNCTION__);
+                poolPut(&lcdev->videoPool, mem);
+                {
+                    Mutex::Autolock lock(lcdev->dropPolicy.lock);
+                    lcdev->dropPolicy.hardDrops++;
+                    lcdev->dropPolicy.framesSent--;
+                }
+                lcdev->hwif->releaseRecordingFrame(dataPtr);
+                return;
+            }
             LOGV("%s: Posting data to client timestamp:%lld", __FUNCTION__, systemTime());
-            lcdev->sentFrames.push_back(mem);
+            start = traceStart();
             lcdev->data_timestamp_callback(timestamp, msgType, mem, /*index*/0, lcdev->user);
+            traceEnd(lcdev, STAGE_TIMESTAMP_CALLBACK, start);
             lcdev->hwif->releaseRecordingFrame(dataPtr);
-            if (mPreviousVideoFrameDropped) {
-                mPreviousVideoFrameDropped = false;
-            }
         } else {
             LOGV("%s: ERROR allocating memory from client", __FUNCTION__);
+            {
+                Mutex::Autolock lock(lcdev->dropPolicy.lock);
+                lcdev->dropPolicy.hardDrops++;
+                lcdev->dropPolicy.framesSent--;
+            }
+            lcdev->hwif->releaseRecordingFrame(dataPtr);
         }
     }
 }
@@ -405,28 +1561,23 @@ inline void destroyOverlay(legacy_camera_device *lcdev)
 
 static void releaseCameraFrames(legacy_camera_device *lcdev)
 {
-    vector<camera_memory_t*>::iterator it;
-    for (it = lcdev->sentFrames.begin(); it != lcdev->sentFrames.end(); ++it) {
-        camera_memory_t *mem = *it;
-        LOGV("%s: releasing mem->data:%p", __FUNCTION__, mem->data);
-        mem->release(mem);
+    sent_frame_table *table = &lcdev->sentFrames;
+    Mutex::Autolock lock(table->lock);
+
+    for (int i = 0; i < SENT_FRAME_SLOTS; i++) {
+        camera_memory_t *mem = table->slots[i];
+        if (mem != NULL) {
+            LOGV("%s: releasing mem->data:%p", __FUNCTION__, mem->data);
+            poolPut(&lcdev->videoPool, mem);
+            table->slots[i] = NULL;
+        }
     }
-    lcdev->sentFrames.clear();
+    table->count = 0;
 }
 
-/* Hardware Camera interface handlers. */
-static int camera_set_preview_window(struct camera_device * device, struct preview_stream_ops *window)
+/* called with the preview thread paused */
+static int setPreviewWindow(struct legacy_camera_device *lcdev, struct preview_stream_ops *window)
 {
-    int rv = -EINVAL;
-    const int kBufferCount = 6;
-    struct legacy_camera_device *lcdev = to_lcdev(device);
-
-    LOGV("%s: Window %p\n", __FUNCTION__, window);
-    if (device == NULL) {
-        LOGE("%s: Invalid device.\n", __FUNCTION__);
-        return -EINVAL;
-    }
-
     if (lcdev->window == window) {
         LOGV("%s: reconfiguring window %p", __FUNCTION__, window);
         destroyOverlay(lcdev);
@@ -485,7 +1636,19 @@ static int camera_set_preview_window(struct camera_device * device, struct previ
         return -1;
     }
 
-    if (window->set_buffers_geometry(window, lcdev->previewWidth, lcdev->previewHeight, HAL_PIXEL_FORMAT_YV12)) {
+    /* YV12 by default; RGB565 windows go through the converter picked by selectRgb565Kernel() */
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.camera.preview.rgb565", value, "0");
+    lcdev->windowFormat = atoi(value) ? HAL_PIXEL_FORMAT_RGB_565 : HAL_PIXEL_FORMAT_YV12;
+
+    /* Convert on a worker thread instead of the vendor callback thread */
+    property_get("ro.camera.preview.async", value, "0");
+    if (atoi(value) && lcdev->previewThread == NULL) {
+        lcdev->previewThread = new PreviewThread(lcdev);
+        lcdev->previewThread->run("CameraPreviewThread", PRIORITY_URGENT_DISPLAY);
+    }
+
+    if (window->set_buffers_geometry(window, lcdev->previewWidth, lcdev->previewHeight, lcdev->windowFormat)) {
         LOGE("%s: could not set buffers geometry", __FUNCTION__);
         return -1;
     }
@@ -500,6 +1663,25 @@ static int camera_set_preview_window(struct camera_device * device, struct previ
     return NO_ERROR;
 }
 
+/* Hardware Camera interface handlers. */
+static int camera_set_preview_window(struct camera_device * device, struct preview_stream_ops *window)
+{
+    int rv = -EINVAL;
+    struct legacy_camera_device *lcdev = to_lcdev(device);
+
+    LOGV("%s: Window %p\n", __FUNCTION__, window);
+    if (device == NULL) {
+        LOGE("%s: Invalid device.\n", __FUNCTION__);
+        return -EINVAL;
+    }
+
+    /* no frame may be queued or converted while the window changes */
+    pausePreviewThread(lcdev);
+    rv = setPreviewWindow(lcdev, window);
+    resumePreviewThread(lcdev);
+    return rv;
+}
+
 static void camera_set_callbacks(struct camera_device * device,
                                  camera_notify_callback notify_cb,
                                  camera_data_callback data_cb,
@@ -559,6 +1741,9 @@ static void camera_stop_preview(struct camera_device * device)
     struct legacy_camera_device *lcdev = to_lcdev(device);
     LOGV("camera_stop_preview:\n");
     lcdev->hwif->stopPreview();
+    /* drop what is still queued */
+    pausePreviewThread(lcdev);
+    resumePreviewThread(lcdev);
     return;
 }
 
@@ -579,8 +1764,8 @@ static int camera_store_meta_data_in_buffers(struct camera_device * device, int
 static int camera_start_recording(struct camera_device * device) 
 {
     struct legacy_camera_device *lcdev = to_lcdev(device);
-    mNumVideoFramesDropped = 0;
-    mPreviousVideoFrameDropped = false;
+    dropPolicyReset(&lcdev->dropPolicy);
+    lcdev->sentFrames.peak = 0;
     mThrottlePreview = false;
     LOGV("%s:", __FUNCTION__);
     lcdev->hwif->startRecording();
@@ -590,9 +1775,13 @@ static int camera_start_recording(struct camera_device * device)
 static void camera_stop_recording(struct camera_device * device)
 {
     struct legacy_camera_device *lcdev = to_lcdev(device);
-    LOGI("%s: Number of frames dropped by CameraHAL: %d", __FUNCTION__, mNumVideoFramesDropped);
+    LOGI("%s: Number of frames dropped by CameraHAL: %u, most frames with the encoder: %u",
+            __FUNCTION__, lcdev->dropPolicy.softDrops + lcdev->dropPolicy.hardDrops,
+            lcdev->sentFrames.peak);
     mThrottlePreview = false;
     lcdev->hwif->stopRecording();
+    /* frames still with the encoder are released when they come back */
+    poolClear(&lcdev->videoPool);
 }
 
 static int camera_recording_enabled(struct camera_device * device)
@@ -607,15 +1796,12 @@ static void camera_release_recording_frame(struct camera_device * device, const
     LOGV("%s: opaque=%p\n", __FUNCTION__, opaque);
     struct legacy_camera_device *lcdev = to_lcdev(device);
     if (opaque != NULL) {
-        vector<camera_memory_t*>::iterator it;
-        for (it = lcdev->sentFrames.begin(); it != lcdev->sentFrames.end(); ++it) {
-            camera_memory_t *mem = *it;
-            if (mem->data == opaque) {
-                LOGV("found, removing");
-                mem->release(mem);
-                lcdev->sentFrames.erase(it);
-                break;
-            }
+        nsecs_t sentTime;
+        camera_memory_t *mem = sentFrameRemove(&lcdev->sentFrames, opaque, &sentTime);
+        if (mem != NULL) {
+            LOGV("found, removing");
+            dropPolicyFrameReleased(&lcdev->dropPolicy, systemTime() - sentTime);
+            poolPut(&lcdev->videoPool, mem);
         }
     }
 }
@@ -669,16 +1855,15 @@ static int camera_set_parameters(struct camera_device * device, const char *para
 static char* camera_get_parameters(struct camera_device * device)
 {
     struct legacy_camera_device *lcdev = to_lcdev(device);
-    CameraParameters params(lcdev->hwif->getParameters());
-
-    
+    String8 params(lcdev->hwif->getFlattenedParameters());
 
-#ifdef LOG_FULL_PARAMS
-    LOGV("%s: Parameters");
-    params.dump();
+#if defined(LOG_FULL_PARAMS) && !LOG_NDEBUG
+    /* apps poll this, only re-parse for the dump in verbose builds */
+    LOGV("%s: Parameters", __FUNCTION__);
+    CameraParameters(params).dump();
 #endif
 
-    return strdup(params.flatten().string());
+    return strdup(params.string());
 }
 
 static void camera_put_parameters(struct camera_device *device, char *params)
@@ -699,12 +1884,17 @@ static void camera_release(struct camera_device * device)
 {
     struct legacy_camera_device *lcdev = to_lcdev(device);
     LOGV("camera_release:\n");
+    /* the worker may still reference overlay buffers */
+    if (lcdev->previewThread != NULL) {
+        lcdev->previewThread->stop();
+        lcdev->previewThread.clear();
+    }
     destroyOverlay(lcdev);
     releaseCameraFrames(lcdev);
-    if (lcdev->clientData != NULL) {
-        lcdev->clientData->release(lcdev->clientData);
-        lcdev->clientData = NULL;
-    }
+    releaseClientData(lcdev, lcdev->clientData, lcdev->clientDataMsgType);
+    lcdev->clientData = NULL;
+    poolClear(&lcdev->previewPool);
+    poolClear(&lcdev->videoPool);
     lcdev->hwif->release();
     lcdev->hwif.clear();
 }
@@ -714,6 +1904,13 @@ static int camera_dump(struct camera_device * device, int fd)
     struct legacy_camera_device *lcdev = to_lcdev(device);
     LOGV("camera_dump:\n");
     Vector<String16> args;
+    String8 result("CameraHAL wrapper:\n");
+    traceDump(lcdev, result);
+    dropPolicyDump(&lcdev->dropPolicy, result);
+    if (lcdev->previewThread != NULL) {
+        lcdev->previewThread->dump(result);
+    }
+    write(fd, result.string(), result.size());
     return lcdev->hwif->dump(fd, args);
 }
 
@@ -793,7 +1990,20 @@ static int camera_device_open(const hw_module_t* module, const char* name, hw_de
     camera_ops->release                    = camera_release;
     camera_ops->dump                       = camera_dump;
 
+    selectRgb565Kernel();
+
+#ifdef CONVERSION_SELF_TEST
+    selfTestYuv422iToYV12();
+    selfTestRgb565();
+#endif
+#ifdef CONVERSION_BENCHMARK
+    benchmarkConverters();
+#endif
+
     lcdev->id = cameraId;
+    lcdev->previewPool.maxSlots = PREVIEW_POOL_SLOTS;
+    lcdev->videoPool.maxSlots = VIDEO_POOL_SLOTS;
+    dropPolicyReset(&lcdev->dropPolicy);
     lcdev->hwif = MotoCameraWrapper::createInstance(cameraId);
     if (lcdev->hwif == NULL) {
         free(camera_ops);
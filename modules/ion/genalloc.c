@@ -12,6 +12,7 @@
 
 #include <linux/module.h>
 #include <linux/genalloc.h>
+#include "genalloc.h"
 
 
 /**
@@ -158,6 +159,171 @@ unsigned long gen_pool_alloc(struct gen_pool *pool, size_t size)
 }
 EXPORT_SYMBOL(gen_pool_alloc);
 
+/*
+ * Returns the first bit of the smallest free run of at least nbits in the
+ * chunk, or -1 if there is none.  Called with chunk->lock held.
+ */
+static int gen_pool_chunk_best_fit(struct gen_pool_chunk *chunk, int end_bit,
+				   int nbits)
+{
+	int start_bit, bit = 0;
+	int best = -1, best_len = INT_MAX;
+
+	while (bit < end_bit) {
+		start_bit = find_next_zero_bit(chunk->bits, end_bit, bit);
+		if (start_bit >= end_bit)
+			break;
+		bit = find_next_bit(chunk->bits, end_bit, start_bit + 1);
+		if (bit - start_bit >= nbits && bit - start_bit < best_len) {
+			best = start_bit;
+			best_len = bit - start_bit;
+			if (best_len == nbits)
+				break;
+		}
+	}
+	return best;
+}
+
+/**
+ * gen_pool_alloc_best_fit - allocate special memory from the pool
+ * @pool: pool to allocate from
+ * @size: number of bytes to allocate from the pool
+ *
+ * Allocate the requested number of bytes from the specified pool, taking
+ * the smallest free range that fits in the first chunk that has one.
+ * Slower than gen_pool_alloc() but leaves the large free ranges intact,
+ * which matters for long lived pools serving mixed sizes.  Both share the
+ * same bitmap, so a pool may be used with either at any time.
+ */
+unsigned long gen_pool_alloc_best_fit(struct gen_pool *pool, size_t size)
+{
+	struct list_head *_chunk;
+	struct gen_pool_chunk *chunk;
+	unsigned long addr, flags;
+	int order = pool->min_alloc_order;
+	int nbits, start_bit, end_bit;
+
+	if (size == 0)
+		return 0;
+
+	nbits = (size + (1UL << order) - 1) >> order;
+
+	read_lock(&pool->lock);
+	list_for_each(_chunk, &pool->chunks) {
+		chunk = list_entry(_chunk, struct gen_pool_chunk, next_chunk);
+
+		end_bit = (chunk->end_addr - chunk->start_addr) >> order;
+
+		spin_lock_irqsave(&chunk->lock, flags);
+		start_bit = gen_pool_chunk_best_fit(chunk, end_bit, nbits);
+		if (start_bit >= 0) {
+			addr = chunk->start_addr +
+					    ((unsigned long)start_bit << order);
+			while (nbits--)
+				__set_bit(start_bit++, chunk->bits);
+			spin_unlock_irqrestore(&chunk->lock, flags);
+			read_unlock(&pool->lock);
+			return addr;
+		}
+		spin_unlock_irqrestore(&chunk->lock, flags);
+	}
+	read_unlock(&pool->lock);
+	return 0;
+}
+EXPORT_SYMBOL(gen_pool_alloc_best_fit);
+
+/*
+ * Returns the first bit of the first free run of at least nbits in the
+ * chunk, or failing that of the largest free run, and its length in *len.
+ * Returns -1 if the chunk is full.  Called with chunk->lock held.
+ */
+static int gen_pool_chunk_largest(struct gen_pool_chunk *chunk, int end_bit,
+				  int nbits, int *len)
+{
+	int start_bit, bit = 0;
+	int best = -1;
+
+	*len = 0;
+	while (bit < end_bit) {
+		start_bit = find_next_zero_bit(chunk->bits, end_bit, bit);
+		if (start_bit >= end_bit)
+			break;
+		bit = find_next_bit(chunk->bits, end_bit, start_bit + 1);
+		if (bit - start_bit > *len) {
+			best = start_bit;
+			*len = bit - start_bit;
+			if (*len >= nbits)
+				break;
+		}
+	}
+	return best;
+}
+
+/**
+ * gen_pool_alloc_largest - allocate up to size bytes of contiguous memory
+ * @pool: pool to allocate from
+ * @size: number of bytes wanted
+ * @alloc_size: set to the number of bytes actually allocated
+ *
+ * Allocate the first free range of @size bytes, or if there is none the
+ * largest free range the pool has.  For callers that can use the memory in
+ * several pieces but want as few pieces as possible.
+ */
+unsigned long gen_pool_alloc_largest(struct gen_pool *pool, size_t size,
+				     size_t *alloc_size)
+{
+	struct list_head *_chunk;
+	struct gen_pool_chunk *chunk, *best = NULL;
+	unsigned long addr, flags;
+	int order = pool->min_alloc_order;
+	int nbits, len, best_len = 0, start_bit, end_bit;
+
+	*alloc_size = 0;
+	if (size == 0)
+		return 0;
+
+	nbits = (size + (1UL << order) - 1) >> order;
+
+	read_lock(&pool->lock);
+	list_for_each(_chunk, &pool->chunks) {
+		chunk = list_entry(_chunk, struct gen_pool_chunk, next_chunk);
+
+		spin_lock_irqsave(&chunk->lock, flags);
+		end_bit = (chunk->end_addr - chunk->start_addr) >> order;
+		gen_pool_chunk_largest(chunk, end_bit, nbits, &len);
+		spin_unlock_irqrestore(&chunk->lock, flags);
+		if (len > best_len) {
+			best = chunk;
+			best_len = len;
+			if (len >= nbits)
+				break;
+		}
+	}
+	if (!best) {
+		read_unlock(&pool->lock);
+		return 0;
+	}
+
+	/* the chunk may have changed since it was scanned, look again */
+	spin_lock_irqsave(&best->lock, flags);
+	end_bit = (best->end_addr - best->start_addr) >> order;
+	start_bit = gen_pool_chunk_largest(best, end_bit, nbits, &len);
+	if (start_bit < 0) {
+		spin_unlock_irqrestore(&best->lock, flags);
+		read_unlock(&pool->lock);
+		return 0;
+	}
+	len = min(len, nbits);
+	addr = best->start_addr + ((unsigned long)start_bit << order);
+	*alloc_size = (size_t)len << order;
+	while (len--)
+		__set_bit(start_bit++, best->bits);
+	spin_unlock_irqrestore(&best->lock, flags);
+	read_unlock(&pool->lock);
+	return addr;
+}
+EXPORT_SYMBOL(gen_pool_alloc_largest);
+
 /**
  * gen_pool_free - free allocated special memory back to the pool
  * @pool: pool to free to
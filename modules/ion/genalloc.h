@@ -0,0 +1,17 @@
+/*
+ * Allocation policies genalloc.c adds to <linux/genalloc.h>
+ *
+ * This source code is licensed under the GNU General Public License,
+ * Version 2.  See the file COPYING for more details.
+ */
+
+#ifndef _ION_GENALLOC_H
+#define _ION_GENALLOC_H
+
+#include <linux/genalloc.h>
+
+unsigned long gen_pool_alloc_best_fit(struct gen_pool *pool, size_t size);
+unsigned long gen_pool_alloc_largest(struct gen_pool *pool, size_t size,
+				     size_t *alloc_size);
+
+#endif /* _ION_GENALLOC_H */
@@ -17,13 +17,16 @@
 #include <linux/device.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/anon_inodes.h>
 #include <linux/ion.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/mm_types.h>
+#include <linux/moduleparam.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/seq_file.h>
@@ -65,15 +68,22 @@ static int ion_put_task_struct(struct task_struct *tsk)
  * struct ion_device - the metadata of the ion device node
  * @dev:		the actual misc device
  * @buffers:	an rb tree of all the existing buffers
- * @lock:		lock protecting the buffers & heaps trees
+ * @buffer_lock:	lock protecting the buffers tree
+ * @lock:		lock protecting the client trees
+ * @heap_lock:		read-mostly lock protecting the heaps tree, only
+ *			written when a heap is added
  * @heaps:		list of all the heaps in the system
+ * @heap_ids:		the same heaps, indexed by id
  * @user_clients:	list of all the clients created from userspace
  */
 struct ion_device {
 	struct miscdevice dev;
 	struct rb_root buffers;
+	struct mutex buffer_lock;
 	struct mutex lock;
+	struct rw_semaphore heap_lock;
 	struct rb_root heaps;
+	struct ion_heap *heap_ids[ION_NUM_HEAP_IDS];
 	long (*custom_ioctl) (struct ion_client *client, unsigned int cmd,
 			      unsigned long arg);
 	struct rb_root user_clients;
@@ -87,10 +97,13 @@ struct ion_device {
  * @node:		node in the tree of all clients
  * @dev:		backpointer to ion device
  * @handles:		an rb tree of all the handles in this client
- * @lock:		lock protecting the tree of handles
+ * @buffer_handles:	the same handles, ordered by the buffer they reference
+ * @lock:		lock protecting the trees of handles
  * @heap_mask:		mask of all supported heaps
  * @name:		used for debugging
  * @task:		used for debugging
+ * @heap_bytes:		bytes of the buffers this client holds, by heap id
+ * @heap_buffers:	number of buffers this client holds, by heap id
  *
  * A client represents a list of buffers this client may access.
  * The mutex stored here is used to protect both handles tree
@@ -101,12 +114,15 @@ struct ion_client {
 	struct rb_node node;
 	struct ion_device *dev;
 	struct rb_root handles;
+	struct rb_root buffer_handles;
 	struct mutex lock;
 	unsigned int heap_mask;
 	const char *name;
 	struct task_struct *task;
 	pid_t pid;
 	struct dentry *debug_root;
+	size_t heap_bytes[ION_NUM_HEAP_IDS];
+	unsigned int heap_buffers[ION_NUM_HEAP_IDS];
 };
 
 /**
@@ -115,6 +131,7 @@ struct ion_client {
  * @client:		back pointer to the client the buffer resides in
  * @buffer:		pointer to the buffer
  * @node:		node in the client's handle rbtree
+ * @buffer_node:	node in the client's rbtree of handles by buffer
  * @kmap_cnt:		count of times this client has mapped to kernel
  * @dmap_cnt:		count of times this client has mapped for dma
  * @usermap_cnt:	count of times this client has mapped for userspace
@@ -127,12 +144,13 @@ struct ion_handle {
 	struct ion_client *client;
 	struct ion_buffer *buffer;
 	struct rb_node node;
+	struct rb_node buffer_node;
 	unsigned int kmap_cnt;
 	unsigned int dmap_cnt;
 	unsigned int usermap_cnt;
 };
 
-/* this function should only be called while dev->lock is held */
+/* this function should only be called while dev->buffer_lock is held */
 static void ion_buffer_add(struct ion_device *dev,
 			   struct ion_buffer *buffer)
 {
@@ -158,7 +176,188 @@ static void ion_buffer_add(struct ion_device *dev,
 	rb_insert_color(&buffer->node, &dev->buffers);
 }
 
-/* this function should only be called while dev->lock is held */
+/*
+ * Heaps that implement recycle keep up to buffer_cache_kb of freed buffers
+ * around and hand them out again for allocations of the same page count,
+ * skipping the heap allocator and the ion_buffer kzalloc.
+ */
+static unsigned int buffer_cache_kb;
+
+/* the caches of every heap, trimmed by the shrinker and on limit changes */
+static LIST_HEAD(ion_buffer_caches);
+static DEFINE_MUTEX(ion_buffer_caches_lock);
+
+static int ion_buffer_cache_trim(struct ion_heap *heap, size_t limit);
+
+/* lowering the limit releases what the caches hold above it right away */
+static int ion_buffer_cache_set_kb(const char *val, struct kernel_param *kp)
+{
+	struct ion_heap *heap;
+	int ret = param_set_uint(val, kp);
+
+	if (ret)
+		return ret;
+
+	mutex_lock(&ion_buffer_caches_lock);
+	list_for_each_entry(heap, &ion_buffer_caches, cache.node) {
+		mutex_lock(&heap->lock);
+		ion_buffer_cache_trim(heap, (size_t)buffer_cache_kb << 10);
+		mutex_unlock(&heap->lock);
+	}
+	mutex_unlock(&ion_buffer_caches_lock);
+	return 0;
+}
+
+module_param_call(buffer_cache_kb, ion_buffer_cache_set_kb, param_get_uint,
+		  &buffer_cache_kb, 0644);
+MODULE_PARM_DESC(buffer_cache_kb,
+		 "freed buffers kept per heap for reuse, in KB (0 disables)");
+
+static int ion_buffer_cache_bucket(size_t size)
+{
+	int bucket = fls(PAGE_ALIGN(size) >> PAGE_SHIFT) - 1;
+
+	return clamp(bucket, 0, ION_CACHE_BUCKETS - 1);
+}
+
+/* this function should only be called while heap->lock is held */
+static struct ion_buffer *ion_buffer_cache_get(struct ion_heap *heap,
+					       size_t len)
+{
+	struct ion_buffer_cache *cache = &heap->cache;
+	struct ion_buffer *buffer;
+	int bucket = ion_buffer_cache_bucket(len);
+
+	if (!heap->ops->recycle || (!buffer_cache_kb && !cache->bytes))
+		return NULL;
+
+	list_for_each_entry(buffer, &cache->buckets[bucket], cache_node) {
+		if (PAGE_ALIGN(buffer->size) == PAGE_ALIGN(len)) {
+			list_del(&buffer->cache_node);
+			cache->bytes -= PAGE_ALIGN(buffer->size);
+			cache->hits++;
+			return buffer;
+		}
+	}
+	cache->misses++;
+	return NULL;
+}
+
+/*
+ * Frees cached buffers, largest first, until no more than limit bytes are
+ * held.  Returns the number of pages released.  This function should only
+ * be called while heap->lock is held.
+ */
+static int ion_buffer_cache_trim(struct ion_heap *heap, size_t limit)
+{
+	struct ion_buffer_cache *cache = &heap->cache;
+	struct ion_buffer *buffer;
+	int i, freed = 0;
+
+	for (i = ION_CACHE_BUCKETS - 1; i >= 0; i--) {
+		while (cache->bytes > limit && !list_empty(&cache->buckets[i])) {
+			buffer = list_first_entry(&cache->buckets[i],
+						  struct ion_buffer, cache_node);
+			list_del(&buffer->cache_node);
+			cache->bytes -= PAGE_ALIGN(buffer->size);
+			freed += PAGE_ALIGN(buffer->size) >> PAGE_SHIFT;
+			heap->ops->free(buffer);
+			kfree(buffer);
+		}
+	}
+	return freed;
+}
+
+/*
+ * Parks a freed buffer in the heap's cache.  Returns false if the buffer
+ * can't be cached and should be freed.  This function should only be
+ * called while heap->lock is held.
+ */
+static bool ion_buffer_cache_put(struct ion_heap *heap,
+				 struct ion_buffer *buffer)
+{
+	struct ion_buffer_cache *cache = &heap->cache;
+	size_t size = PAGE_ALIGN(buffer->size);
+	size_t limit = (size_t)buffer_cache_kb << 10;
+
+	if (!heap->ops->recycle || size > limit)
+		return false;
+	if (buffer->kmap_cnt || buffer->dmap_cnt)
+		return false;
+
+	ion_buffer_cache_trim(heap, limit - size);
+	list_add(&buffer->cache_node,
+		 &cache->buckets[ion_buffer_cache_bucket(size)]);
+	cache->bytes += size;
+	return true;
+}
+
+/* 2.6.32 shrinker interface, the callback gets no context */
+static int ion_buffer_cache_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct ion_heap *heap;
+	int count = 0;
+
+	if (!mutex_trylock(&ion_buffer_caches_lock))
+		return nr_to_scan ? -1 : 0;
+
+	list_for_each_entry(heap, &ion_buffer_caches, cache.node) {
+		/*
+		 * the heap lock is held across allocate, which may be what
+		 * got us here, so never wait for it
+		 */
+		if (nr_to_scan > 0 && mutex_trylock(&heap->lock)) {
+			size_t scan = (size_t)nr_to_scan << PAGE_SHIFT;
+			size_t bytes = heap->cache.bytes;
+
+			nr_to_scan -= ion_buffer_cache_trim(heap,
+					bytes > scan ? bytes - scan : 0);
+			mutex_unlock(&heap->lock);
+		}
+		count += heap->cache.bytes >> PAGE_SHIFT;
+	}
+	mutex_unlock(&ion_buffer_caches_lock);
+	return count;
+}
+
+static struct shrinker ion_buffer_cache_shrinker = {
+	.shrink = ion_buffer_cache_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int ion_latency_bucket(ktime_t start)
+{
+	s64 us = ktime_to_us(ktime_sub(ktime_get(), start));
+
+	if (us <= 0)
+		return 0;
+	if (us >= 1 << (ION_LATENCY_BUCKETS - 1))
+		return ION_LATENCY_BUCKETS - 1;
+	return fls((int)us);
+}
+
+/* this function should only be called while heap->lock is held */
+static void ion_heap_account(struct ion_heap *heap, ssize_t bytes,
+			     int buffers)
+{
+	struct ion_heap_stats *stats = &heap->stats;
+
+	stats->bytes += bytes;
+	stats->buffers += buffers;
+	if (stats->bytes > stats->peak_bytes)
+		stats->peak_bytes = stats->bytes;
+}
+
+/* this function should only be called while client->lock is held */
+static void ion_client_account(struct ion_client *client,
+			       struct ion_heap *heap, ssize_t bytes,
+			       int buffers)
+{
+	client->heap_bytes[heap->id] += bytes;
+	client->heap_buffers[heap->id] += buffers;
+}
+
+/* this function should only be called while dev->heap_lock is held */
 static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     struct ion_device *dev,
 				     unsigned long len,
@@ -166,24 +365,47 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 				     unsigned long flags)
 {
 	struct ion_buffer *buffer;
+	ktime_t start = ktime_get();
 	int ret;
 
-	buffer = kzalloc(sizeof(struct ion_buffer), GFP_KERNEL);
-	if (!buffer)
-		return ERR_PTR(-ENOMEM);
+	mutex_lock(&heap->lock);
+	buffer = ion_buffer_cache_get(heap, len);
+	if (buffer) {
+		heap->ops->recycle(buffer);
+	} else {
+		buffer = kzalloc(sizeof(struct ion_buffer), GFP_KERNEL);
+		if (!buffer) {
+			mutex_unlock(&heap->lock);
+			return ERR_PTR(-ENOMEM);
+		}
+		buffer->heap = heap;
+
+		ret = heap->ops->allocate(heap, buffer, len, align, flags);
+		if (ret && heap->cache.bytes) {
+			/* the cache may be sitting on the space we need */
+			ion_buffer_cache_trim(heap, 0);
+			ret = heap->ops->allocate(heap, buffer, len, align,
+						  flags);
+		}
+		if (ret) {
+			heap->stats.failures++;
+			mutex_unlock(&heap->lock);
+			kfree(buffer);
+			return ERR_PTR(ret);
+		}
+	}
+	ion_heap_account(heap, len, 1);
+	heap->stats.latency[ion_latency_bucket(start)]++;
+	mutex_unlock(&heap->lock);
 
-	buffer->heap = heap;
 	kref_init(&buffer->ref);
-
-	ret = heap->ops->allocate(heap, buffer, len, align, flags);
-	if (ret) {
-		kfree(buffer);
-		return ERR_PTR(ret);
-	}
 	buffer->dev = dev;
+	buffer->flags = flags;
 	buffer->size = len;
 	mutex_init(&buffer->lock);
+	mutex_lock(&dev->buffer_lock);
 	ion_buffer_add(dev, buffer);
+	mutex_unlock(&dev->buffer_lock);
 	return buffer;
 }
 
@@ -191,12 +413,21 @@ static void ion_buffer_destroy(struct kref *kref)
 {
 	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
 	struct ion_device *dev = buffer->dev;
+	struct ion_heap *heap = buffer->heap;
+	bool cached;
 
-	buffer->heap->ops->free(buffer);
-	mutex_lock(&dev->lock);
+	mutex_lock(&dev->buffer_lock);
 	rb_erase(&buffer->node, &dev->buffers);
-	mutex_unlock(&dev->lock);
-	kfree(buffer);
+	mutex_unlock(&dev->buffer_lock);
+
+	mutex_lock(&heap->lock);
+	ion_heap_account(heap, -(ssize_t)buffer->size, -1);
+	cached = ion_buffer_cache_put(heap, buffer);
+	if (!cached)
+		heap->ops->free(buffer);
+	mutex_unlock(&heap->lock);
+	if (!cached)
+		kfree(buffer);
 }
 
 static void ion_buffer_get(struct ion_buffer *buffer)
@@ -219,6 +450,7 @@ static struct ion_handle *ion_handle_create(struct ion_client *client,
 		return ERR_PTR(-ENOMEM);
 	kref_init(&handle->ref);
 	rb_init_node(&handle->node);
+	rb_init_node(&handle->buffer_node);
 	handle->client = client;
 	ion_buffer_get(buffer);
 	handle->buffer = buffer;
@@ -229,14 +461,21 @@ static struct ion_handle *ion_handle_create(struct ion_client *client,
 static void ion_handle_destroy(struct kref *kref)
 {
 	struct ion_handle *handle = container_of(kref, struct ion_handle, ref);
+	struct ion_buffer *buffer = handle->buffer;
 	/* XXX Can a handle be destroyed while it's map count is non-zero?:
 	   if (handle->map_cnt) unmap
 	 */
-	ion_buffer_put(handle->buffer);
 	mutex_lock(&handle->client->lock);
-	if (!RB_EMPTY_NODE(&handle->node))
+	if (!RB_EMPTY_NODE(&handle->node)) {
 		rb_erase(&handle->node, &handle->client->handles);
+		ion_client_account(handle->client, buffer->heap,
+				   -(ssize_t)buffer->size, -1);
+	}
+	if (!RB_EMPTY_NODE(&handle->buffer_node))
+		rb_erase(&handle->buffer_node, &handle->client->buffer_handles);
 	mutex_unlock(&handle->client->lock);
+	/* drop the buffer last, the accounting above still reads it */
+	ion_buffer_put(buffer);
 	kfree(handle);
 }
 
@@ -255,15 +494,20 @@ static int ion_handle_put(struct ion_handle *handle)
 	return kref_put(&handle->ref, ion_handle_destroy);
 }
 
+/* this function should only be called while client->lock is held */
 static struct ion_handle *ion_handle_lookup(struct ion_client *client,
 					    struct ion_buffer *buffer)
 {
-	struct rb_node *n;
+	struct rb_node *n = client->buffer_handles.rb_node;
 
-	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
+	while (n) {
 		struct ion_handle *handle = rb_entry(n, struct ion_handle,
-						     node);
-		if (handle->buffer == buffer)
+						     buffer_node);
+		if (buffer < handle->buffer)
+			n = n->rb_left;
+		else if (buffer > handle->buffer)
+			n = n->rb_right;
+		else
 			return handle;
 	}
 	return NULL;
@@ -306,36 +550,82 @@ static void ion_handle_add(struct ion_client *client, struct ion_handle *handle)
 
 	rb_link_node(&handle->node, parent, p);
 	rb_insert_color(&handle->node, &client->handles);
+	ion_client_account(client, handle->buffer->heap, handle->buffer->size,
+			   1);
+
+	/* index by buffer as well, for ion_handle_lookup */
+	p = &client->buffer_handles.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ion_handle, buffer_node);
+
+		if (handle->buffer < entry->buffer) {
+			p = &(*p)->rb_left;
+		} else if (handle->buffer > entry->buffer) {
+			p = &(*p)->rb_right;
+		} else {
+			WARN(1, "%s: buffer already has a handle.", __func__);
+			return;
+		}
+	}
+
+	rb_link_node(&handle->buffer_node, parent, p);
+	rb_insert_color(&handle->buffer_node, &client->buffer_handles);
 }
 
-struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
-			     size_t align, unsigned int flags)
+/*
+ * traverse the list of heaps available in this system in priority
+ * order, starting at *from.  If the heap type is supported by the client,
+ * and matches the request of the caller allocate from it.  Repeat until
+ * allocate has succeeded or all heaps have been tried, and leave *from on
+ * the heap that succeeded.  Heaps are only added at init, so the walk
+ * only needs the heaps tree read locked and allocations from different
+ * heaps don't serialize on each other.
+ *
+ * this function should only be called while dev->heap_lock is held
+ */
+static struct ion_buffer *ion_heaps_alloc(struct ion_client *client,
+					  struct rb_node **from, size_t len,
+					  size_t align, unsigned int flags)
 {
-	struct rb_node *n;
-	struct ion_handle *handle;
 	struct ion_device *dev = client->dev;
 	struct ion_buffer *buffer = NULL;
+	struct rb_node *n;
 
-	/*
-	 * traverse the list of heaps available in this system in priority
-	 * order.  If the heap type is supported by the client, and matches the
-	 * request of the caller allocate from it.  Repeat until allocate has
-	 * succeeded or all heaps have been tried
-	 */
-	mutex_lock(&dev->lock);
-	for (n = rb_first(&dev->heaps); n != NULL; n = rb_next(n)) {
+	/* both mapping flags is an all-ones mask, not a request for either */
+	if ((flags & ION_FLAG_MAPPING_MASK) == ION_FLAG_MAPPING_MASK)
+		flags &= ~ION_FLAG_MAPPING_MASK;
+
+	for (n = *from; n != NULL; n = rb_next(n)) {
 		struct ion_heap *heap = rb_entry(n, struct ion_heap, node);
 		/* if the client doesn't support this heap type */
 		if (!((1 << heap->type) & client->heap_mask))
 			continue;
 		/* if the caller didn't specify this heap type */
-		if (!((1 << heap->id) & flags))
+		if (!((1 << heap->id) & flags & ION_HEAP_ID_MASK))
 			continue;
 		buffer = ion_buffer_create(heap, dev, len, align, flags);
-		if (!IS_ERR_OR_NULL(buffer))
+		if (!IS_ERR_OR_NULL(buffer)) {
+			*from = n;
 			break;
+		}
 	}
-	mutex_unlock(&dev->lock);
+	return buffer;
+}
+
+struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
+			     size_t align, unsigned int flags)
+{
+	struct rb_node *n;
+	struct ion_handle *handle;
+	struct ion_device *dev = client->dev;
+	struct ion_buffer *buffer = NULL;
+
+	down_read(&dev->heap_lock);
+	n = rb_first(&dev->heaps);
+	buffer = ion_heaps_alloc(client, &n, len, align, flags);
+	up_read(&dev->heap_lock);
 
 	if (IS_ERR_OR_NULL(buffer))
 		return ERR_PTR(PTR_ERR(buffer));
@@ -362,6 +652,57 @@ end:
 }
 EXPORT_SYMBOL(ion_alloc);
 
+int ion_alloc_batch(struct ion_client *client, size_t len, size_t align,
+		    unsigned int flags, unsigned int count,
+		    struct ion_handle **handles)
+{
+	struct ion_device *dev = client->dev;
+	struct ion_buffer *buffer;
+	struct rb_node *n;
+	unsigned int i;
+	int ret = 0;
+
+	/*
+	 * one heap walk for the whole batch: later buffers start at the heap
+	 * that satisfied the previous one, the heaps before it are full
+	 */
+	down_read(&dev->heap_lock);
+	n = rb_first(&dev->heaps);
+	for (i = 0; i < count; i++) {
+		buffer = ion_heaps_alloc(client, &n, len, align, flags);
+		if (IS_ERR_OR_NULL(buffer)) {
+			ret = buffer ? PTR_ERR(buffer) : -ENODEV;
+			break;
+		}
+		handles[i] = ion_handle_create(client, buffer);
+		/*
+		 * ion_buffer_create will create a buffer with a ref_cnt of 1,
+		 * and ion_handle_create will take a second reference, drop
+		 * one here
+		 */
+		ion_buffer_put(buffer);
+		if (IS_ERR(handles[i])) {
+			ret = PTR_ERR(handles[i]);
+			break;
+		}
+	}
+	up_read(&dev->heap_lock);
+
+	if (ret) {
+		/* all or nothing, none of these were added to the client */
+		while (i--)
+			ion_handle_put(handles[i]);
+		return ret;
+	}
+
+	mutex_lock(&client->lock);
+	for (i = 0; i < count; i++)
+		ion_handle_add(client, handles[i]);
+	mutex_unlock(&client->lock);
+	return 0;
+}
+EXPORT_SYMBOL(ion_alloc_batch);
+
 void ion_free(struct ion_client *client, struct ion_handle *handle)
 {
 	bool valid_handle;
@@ -545,6 +886,60 @@ void ion_unmap_dma(struct ion_client *client, struct ion_handle *handle)
 }
 EXPORT_SYMBOL(ion_unmap_dma);
 
+int ion_sync(struct ion_client *client, struct ion_handle *handle,
+	     size_t offset, size_t len, unsigned int op)
+{
+	struct ion_buffer *buffer;
+	int ret;
+
+	mutex_lock(&client->lock);
+	if (!ion_handle_validate(client, handle)) {
+		pr_err("%s: invalid handle passed to sync.\n", __func__);
+		mutex_unlock(&client->lock);
+		return -EINVAL;
+	}
+	buffer = handle->buffer;
+	mutex_unlock(&client->lock);
+
+	if (op > ION_SYNC_FLUSH || offset > buffer->size ||
+	    len > buffer->size - offset)
+		return -EINVAL;
+	/* uncached or write-combined only, nothing to maintain */
+	if (!buffer->heap->ops->sync)
+		return 0;
+
+	mutex_lock(&buffer->lock);
+	ret = buffer->heap->ops->sync(buffer->heap, buffer, offset, len, op);
+	mutex_unlock(&buffer->lock);
+	return ret;
+}
+EXPORT_SYMBOL(ion_sync);
+
+void ion_buffer_set_size(struct ion_client *client, struct ion_handle *handle,
+			 size_t size)
+{
+	struct ion_buffer *buffer = handle->buffer;
+	ssize_t delta = size - buffer->size;
+
+	mutex_lock(&client->lock);
+	ion_client_account(client, buffer->heap, delta, 0);
+	mutex_unlock(&client->lock);
+
+	mutex_lock(&buffer->heap->lock);
+	ion_heap_account(buffer->heap, delta, 0);
+	buffer->size = size;
+	mutex_unlock(&buffer->heap->lock);
+}
+
+pgprot_t ion_buffer_pgprot(struct ion_buffer *buffer, pgprot_t prot)
+{
+	if (buffer->flags & ION_FLAG_CACHED)
+		return prot;
+	if (buffer->flags & ION_FLAG_WRITECOMBINE)
+		return pgprot_writecombine(prot);
+	return pgprot_noncached(prot);
+}
+
 struct ion_buffer *ion_share(struct ion_client *client,
 				 struct ion_handle *handle)
 {
@@ -616,28 +1011,17 @@ EXPORT_SYMBOL(ion_import_fd);
 static int ion_debug_client_show(struct seq_file *s, void *unused)
 {
 	struct ion_client *client = s->private;
-	struct rb_node *n;
-	size_t sizes[ION_NUM_HEAPS] = {0};
-	const char *names[ION_NUM_HEAPS] = {0};
+	struct ion_device *dev = client->dev;
 	int i;
 
-	mutex_lock(&client->lock);
-	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
-		struct ion_handle *handle = rb_entry(n, struct ion_handle,
-						     node);
-		enum ion_heap_type type = handle->buffer->heap->type;
-
-		if (!names[type])
-			names[type] = handle->buffer->heap->name;
-		sizes[type] += handle->buffer->size;
-	}
-	mutex_unlock(&client->lock);
-
-	seq_printf(s, "%16.16s: %16.16s\n", "heap_name", "size_in_bytes");
-	for (i = 0; i < ION_NUM_HEAPS; i++) {
-		if (!names[i])
+	/* running counters, no need to walk the handles or lock the client */
+	seq_printf(s, "%16.16s: %16.16s %16.16s\n", "heap_name",
+		   "size_in_bytes", "buffers");
+	for (i = 0; i < ION_NUM_HEAP_IDS; i++) {
+		if (!client->heap_buffers[i] || !dev->heap_ids[i])
 			continue;
-		seq_printf(s, "%16.16s: %16u %d\n", names[i], sizes[i],
+		seq_printf(s, "%16.16s: %16u %16u %d\n", dev->heap_ids[i]->name,
+			   client->heap_bytes[i], client->heap_buffers[i],
 			   atomic_read(&client->ref.refcount));
 	}
 	return 0;
@@ -721,6 +1105,7 @@ struct ion_client *ion_client_create(struct ion_device *dev,
 
 	client->dev = dev;
 	client->handles = RB_ROOT;
+	client->buffer_handles = RB_ROOT;
 	mutex_init(&client->lock);
 	client->name = name;
 	client->heap_mask = heap_mask;
@@ -876,6 +1261,62 @@ static struct vm_operations_struct ion_vm_ops = {
 	.close = ion_vma_close,
 };
 
+/*
+ * Heaps that implement user_pfn can be mapped on demand: mmap only sets up
+ * the vma and each fault populates up to lazy_map_pages pages from the
+ * faulting one on.  Clients that map a large buffer to peek at a header
+ * then don't pay for page tables covering all of it.  0 maps the whole
+ * buffer up front through map_user.
+ */
+static unsigned int lazy_map_pages;
+module_param(lazy_map_pages, uint, 0644);
+MODULE_PARM_DESC(lazy_map_pages,
+		 "pages to map per fault on lazily mapped buffers (0 maps eagerly)");
+
+static int ion_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct ion_buffer *buffer = vma->vm_file->private_data;
+	struct ion_heap *heap = buffer->heap;
+	unsigned long addr = (unsigned long)vmf->virtual_address & PAGE_MASK;
+	unsigned long pgoff = vmf->pgoff;
+	unsigned long npages = PAGE_ALIGN(buffer->size) >> PAGE_SHIFT;
+	unsigned int i, chunk = max(lazy_map_pages, 1U);
+	int ret;
+
+	if (pgoff >= npages)
+		return VM_FAULT_SIGBUS;
+
+	for (i = 0; i < chunk; i++, addr += PAGE_SIZE, pgoff++) {
+		if (addr >= vma->vm_end || pgoff >= npages)
+			break;
+		ret = vm_insert_pfn(vma, addr,
+				    heap->ops->user_pfn(heap, buffer, pgoff));
+		/* -EBUSY: already populated, by a racing fault or an
+		   earlier prefault */
+		if (ret && ret != -EBUSY) {
+			if (i)
+				break;
+			return ret == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+		}
+	}
+	return VM_FAULT_NOPAGE;
+}
+
+static struct vm_operations_struct ion_vm_lazy_ops = {
+	.open = ion_vma_open,
+	.close = ion_vma_close,
+	.fault = ion_vma_fault,
+};
+
+/* vm_insert_pfn can't back private writable mappings */
+static bool ion_can_map_lazily(struct ion_buffer *buffer,
+			       struct vm_area_struct *vma)
+{
+	if (!lazy_map_pages || !buffer->heap->ops->user_pfn)
+		return false;
+	return (vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) != VM_MAYWRITE;
+}
+
 static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct ion_buffer *buffer = file->private_data;
@@ -910,24 +1351,32 @@ static int ion_share_mmap(struct file *file, struct vm_area_struct *vma)
 		goto err;
 	}
 
-	if (!handle->buffer->heap->ops->map_user) {
-		pr_err("%s: this heap does not define a method for mapping "
-		       "to userspace\n", __func__);
-		ret = -EINVAL;
-		goto err1;
-	}
+	if (ion_can_map_lazily(buffer, vma)) {
+		/* pages are inserted by ion_vma_fault */
+		vma->vm_flags |= VM_IO | VM_PFNMAP | VM_RESERVED;
+		vma->vm_page_prot = ion_buffer_pgprot(buffer,
+						      vma->vm_page_prot);
+		vma->vm_ops = &ion_vm_lazy_ops;
+	} else {
+		if (!handle->buffer->heap->ops->map_user) {
+			pr_err("%s: this heap does not define a method for "
+			       "mapping to userspace\n", __func__);
+			ret = -EINVAL;
+			goto err1;
+		}
 
-	mutex_lock(&buffer->lock);
-	/* now map it to userspace */
-	ret = buffer->heap->ops->map_user(buffer->heap, buffer, vma);
-	mutex_unlock(&buffer->lock);
-	if (ret) {
-		pr_err("%s: failure mapping buffer to userspace\n",
-		       __func__);
-		goto err1;
-	}
+		mutex_lock(&buffer->lock);
+		/* now map it to userspace */
+		ret = buffer->heap->ops->map_user(buffer->heap, buffer, vma);
+		mutex_unlock(&buffer->lock);
+		if (ret) {
+			pr_err("%s: failure mapping buffer to userspace\n",
+			       __func__);
+			goto err1;
+		}
 
-	vma->vm_ops = &ion_vm_ops;
+		vma->vm_ops = &ion_vm_ops;
+	}
 	/* move the handle into the vm_private_data so we can access it from
 	   vma_open/close */
 	vma->vm_private_data = handle;
@@ -1006,6 +1455,29 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			return -EFAULT;
 		break;
 	}
+	case ION_IOC_ALLOC_BATCH:
+	{
+		struct ion_allocation_batch_data data;
+		struct ion_handle *handles[ION_ALLOC_BATCH_MAX];
+		unsigned int i;
+		int ret;
+
+		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
+			return -EFAULT;
+		if (!data.count || data.count > ION_ALLOC_BATCH_MAX)
+			return -EINVAL;
+		ret = ion_alloc_batch(client, data.len, data.align, data.flags,
+				      data.count, handles);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *)data.handles, handles,
+				 data.count * sizeof(*handles))) {
+			for (i = 0; i < data.count; i++)
+				ion_free(client, handles[i]);
+			return -EFAULT;
+		}
+		break;
+	}
 	case ION_IOC_FREE:
 	{
 		struct ion_handle_data data;
@@ -1057,6 +1529,15 @@ static long ion_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			return -EFAULT;
 		break;
 	}
+	case ION_IOC_SYNC:
+	{
+		struct ion_sync_data data;
+
+		if (copy_from_user(&data, (void __user *)arg, sizeof(data)))
+			return -EFAULT;
+		return ion_sync(client, data.handle, data.offset, data.len,
+				data.op);
+	}
 	case ION_IOC_CUSTOM:
 	{
 		struct ion_device *dev = client->dev;
@@ -1122,36 +1603,20 @@ static const struct file_operations ion_fops = {
 	.unlocked_ioctl = ion_ioctl,
 };
 
-static size_t ion_debug_heap_total(struct ion_client *client,
-				   enum ion_heap_type type)
-{
-	size_t size = 0;
-	struct rb_node *n;
-
-	mutex_lock(&client->lock);
-	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
-		struct ion_handle *handle = rb_entry(n,
-						     struct ion_handle,
-						     node);
-		if (handle->buffer->heap->type == type)
-			size += handle->buffer->size;
-	}
-	mutex_unlock(&client->lock);
-	return size;
-}
-
 static int ion_debug_heap_show(struct seq_file *s, void *unused)
 {
 	struct ion_heap *heap = s->private;
 	struct ion_device *dev = heap->dev;
+	struct ion_heap_stats stats;
 	struct rb_node *n;
+	int i;
 
 	seq_printf(s, "%16.s %16.s %16.s\n", "client", "pid", "size");
 	for (n = rb_first(&dev->user_clients); n; n = rb_next(n)) {
 		struct ion_client *client = rb_entry(n, struct ion_client,
 						     node);
 		char task_comm[TASK_COMM_LEN];
-		size_t size = ion_debug_heap_total(client, heap->type);
+		size_t size = client->heap_bytes[heap->id];
 		if (!size)
 			continue;
 
@@ -1163,12 +1628,33 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 	for (n = rb_first(&dev->kernel_clients); n; n = rb_next(n)) {
 		struct ion_client *client = rb_entry(n, struct ion_client,
 						     node);
-		size_t size = ion_debug_heap_total(client, heap->type);
+		size_t size = client->heap_bytes[heap->id];
 		if (!size)
 			continue;
 		seq_printf(s, "%16.s %16u %16u\n", client->name, client->pid,
 			   size);
 	}
+
+	mutex_lock(&heap->lock);
+	stats = heap->stats;
+	mutex_unlock(&heap->lock);
+	seq_printf(s, "\ntotal: %u bytes in %u buffers, peak %u bytes, "
+		   "%lu failed allocations\n", stats.bytes, stats.buffers,
+		   stats.peak_bytes, stats.failures);
+	seq_printf(s, "allocation latency:");
+	for (i = 0; i < ION_LATENCY_BUCKETS - 1; i++)
+		seq_printf(s, " <%uus:%lu", 1 << i, stats.latency[i]);
+	seq_printf(s, " more:%lu\n", stats.latency[i]);
+
+	if (heap->ops->recycle) {
+		mutex_lock(&heap->lock);
+		seq_printf(s, "\ncache: %u bytes, %lu hits, %lu misses\n",
+			   heap->cache.bytes, heap->cache.hits,
+			   heap->cache.misses);
+		mutex_unlock(&heap->lock);
+	}
+	if (heap->ops->debug_show)
+		heap->ops->debug_show(heap, s);
 	return 0;
 }
 
@@ -1190,12 +1676,26 @@ void ion_device_add_heap(struct ion_device *dev, struct ion_heap *heap)
 	struct rb_node *n, *parent = NULL;
 	struct ion_heap *entry;
 	unsigned int entries = 0;
+	int i;
 
 	pr_info("%s: heap = %p\n", __func__, &dev->heaps);
 	pr_info("%s: heap->id = %x\n", __func__, heap->id);
 	pr_info("%s: heap->id = %x\n", __func__, heap->id);
+	if (heap->id < 0 || heap->id >= ION_NUM_HEAP_IDS) {
+		pr_err("%s: heap id %d is out of range\n", __func__, heap->id);
+		return;
+	}
 	heap->dev = dev;
-	mutex_lock(&dev->lock);
+	mutex_init(&heap->lock);
+	for (i = 0; i < ION_CACHE_BUCKETS; i++)
+		INIT_LIST_HEAD(&heap->cache.buckets[i]);
+	INIT_LIST_HEAD(&heap->cache.node);
+	if (heap->ops->recycle) {
+		mutex_lock(&ion_buffer_caches_lock);
+		list_add(&heap->cache.node, &ion_buffer_caches);
+		mutex_unlock(&ion_buffer_caches_lock);
+	}
+	down_write(&dev->heap_lock);
 
 	while (*p) {
 		parent = *p;
@@ -1213,6 +1713,7 @@ break;  // <<---------------------------------------------------------------- to
 		entries++;
 	}
 	rb_link_node(&heap->node, parent, p);
+	dev->heap_ids[heap->id] = heap;
 #if 0 // <<------------------------------------------------------------------ to fix :/
 	rb_insert_color(&heap->node, &dev->heaps);
 #endif
@@ -1221,7 +1722,7 @@ break;  // <<---------------------------------------------------------------- to
 			    &debug_heap_fops);
 #endif
 end:
-	mutex_unlock(&dev->lock);
+	up_write(&dev->heap_lock);
 	pr_info("%s: %u entries\n", __func__, entries);
 }
 
@@ -1260,15 +1761,34 @@ struct ion_device *ion_device_create(long (*custom_ioctl)
 
 	idev->custom_ioctl = custom_ioctl;
 	idev->buffers = RB_ROOT;
+	mutex_init(&idev->buffer_lock);
 	mutex_init(&idev->lock);
+	init_rwsem(&idev->heap_lock);
 	idev->heaps = RB_ROOT;
 	idev->user_clients = RB_ROOT;
 	idev->kernel_clients = RB_ROOT;
+	register_shrinker(&ion_buffer_cache_shrinker);
 	return idev;
 }
 
 void ion_device_destroy(struct ion_device *dev)
 {
+	struct rb_node *n;
+
+	unregister_shrinker(&ion_buffer_cache_shrinker);
+	/* the heaps are destroyed after us, release what they still cache */
+	down_write(&dev->heap_lock);
+	for (n = rb_first(&dev->heaps); n != NULL; n = rb_next(n)) {
+		struct ion_heap *heap = rb_entry(n, struct ion_heap, node);
+
+		mutex_lock(&heap->lock);
+		ion_buffer_cache_trim(heap, 0);
+		mutex_unlock(&heap->lock);
+		mutex_lock(&ion_buffer_caches_lock);
+		list_del_init(&heap->cache.node);
+		mutex_unlock(&ion_buffer_caches_lock);
+	}
+	up_write(&dev->heap_lock);
 	misc_deregister(&dev->dev);
 	/* XXX need to free the heaps and clients ? */
 	kfree(dev);
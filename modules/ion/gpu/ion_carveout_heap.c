@@ -20,13 +20,26 @@
 #include <linux/io.h>
 #include <linux/ion.h>
 #include <linux/mm.h>
+#include <linux/moduleparam.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
+#include "../genalloc.h"
 
+#include <asm/cacheflush.h>
 #include <asm/mach/map.h>
 
+/*
+ * First fit splits the large free ranges over a long uptime until big
+ * camera buffers no longer fit, best fit keeps them whole.  Both policies
+ * work off the same bitmap, so this may be flipped at runtime.
+ */
+static int carveout_best_fit = 1;
+module_param(carveout_best_fit, bool, 0644);
+MODULE_PARM_DESC(carveout_best_fit,
+		 "allocate carveout buffers best fit instead of first fit");
+
 struct ion_carveout_heap {
 	struct ion_heap heap;
 	struct gen_pool *pool;
@@ -39,11 +52,33 @@ ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap,
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
-	unsigned long offset = gen_pool_alloc(carveout_heap->pool, size);
+	unsigned long offset;
+
+	if (carveout_best_fit)
+		offset = gen_pool_alloc_best_fit(carveout_heap->pool, size);
+	else
+		offset = gen_pool_alloc(carveout_heap->pool, size);
+
+	if (!offset)
+		return ION_CARVEOUT_ALLOCATE_FAIL;
+
+	return offset;
+}
+
+ion_phys_addr_t ion_carveout_allocate_extent(struct ion_heap *heap,
+					     unsigned long size,
+					     unsigned long *alloc_size)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	size_t len;
+	unsigned long offset = gen_pool_alloc_largest(carveout_heap->pool,
+						      size, &len);
 
 	if (!offset)
 		return ION_CARVEOUT_ALLOCATE_FAIL;
 
+	*alloc_size = len;
 	return offset;
 }
 
@@ -76,31 +111,123 @@ static int ion_carveout_heap_allocate(struct ion_heap *heap,
 	return buffer->priv_phys == ION_CARVEOUT_ALLOCATE_FAIL ? -ENOMEM : 0;
 }
 
+/*
+ * Cache maintenance by virtual address needs a cacheable mapping of the
+ * range, use the kernel mapping if the buffer has one and a temporary one
+ * otherwise.  Called with buffer->lock held or once the buffer is unused.
+ */
+static int ion_carveout_heap_sync(struct ion_heap *heap,
+				  struct ion_buffer *buffer,
+				  size_t offset, size_t len, unsigned int op)
+{
+	ion_phys_addr_t start = buffer->priv_phys + offset;
+	void *vaddr, *mapping = NULL;
+
+	/* uncached and write-combined mappings leave nothing to maintain */
+	if (!(buffer->flags & ION_FLAG_CACHED) || !len)
+		return 0;
+
+	if (buffer->vaddr) {
+		vaddr = buffer->vaddr + offset;
+	} else {
+		mapping = __arch_ioremap(start & PAGE_MASK,
+					 PAGE_ALIGN(len + (start & ~PAGE_MASK)),
+					 MT_MEMORY);
+		if (!mapping)
+			return -ENOMEM;
+		vaddr = mapping + (start & ~PAGE_MASK);
+	}
+
+	switch (op) {
+	case ION_SYNC_CLEAN:
+		dmac_clean_range(vaddr, vaddr + len);
+		outer_clean_range(start, start + len);
+		break;
+	case ION_SYNC_INVALIDATE:
+		outer_inv_range(start, start + len);
+		dmac_inv_range(vaddr, vaddr + len);
+		break;
+	case ION_SYNC_FLUSH:
+		dmac_flush_range(vaddr, vaddr + len);
+		outer_flush_range(start, start + len);
+		break;
+	}
+
+	if (mapping)
+		__arch_iounmap(mapping);
+	return 0;
+}
+
 static void ion_carveout_heap_free(struct ion_buffer *buffer)
 {
 	struct ion_heap *heap = buffer->heap;
 
+	/* don't let dirty lines land on the next, maybe uncached, owner */
+	ion_carveout_heap_sync(heap, buffer, 0, buffer->size, ION_SYNC_FLUSH);
+	kfree(buffer->sg_cache);
+	buffer->sg_cache = NULL;
+
 	ion_carveout_free(heap, buffer->priv_phys, buffer->size);
 	buffer->priv_phys = ION_CARVEOUT_ALLOCATE_FAIL;
 }
 
+unsigned long ion_carveout_heap_user_pfn(struct ion_heap *heap,
+					 struct ion_buffer *buffer,
+					 unsigned long pgoff)
+{
+	return __phys_to_pfn(buffer->priv_phys) + pgoff;
+}
+
+static void ion_carveout_heap_recycle(struct ion_buffer *buffer)
+{
+	/* carveout memory isn't cleared on allocation either, but the next
+	   owner may map it uncached */
+	ion_carveout_heap_sync(buffer->heap, buffer, 0, buffer->size,
+			       ION_SYNC_FLUSH);
+	/* the next owner may ask for a different length */
+	kfree(buffer->sg_cache);
+	buffer->sg_cache = NULL;
+}
+
+/*
+ * A carveout buffer is a single physically contiguous range, so its
+ * scatterlist is one entry that stays valid for the life of the buffer.
+ * Build it on the first map_dma and hand the same one out after that.
+ */
 struct scatterlist *ion_carveout_heap_map_dma(struct ion_heap *heap,
 					      struct ion_buffer *buffer)
 {
-	return ERR_PTR(-EINVAL);
+	struct scatterlist *sglist = buffer->sg_cache;
+
+	if (sglist)
+		return sglist;
+
+	sglist = kmalloc(sizeof(struct scatterlist), GFP_KERNEL);
+	if (!sglist)
+		return ERR_PTR(-ENOMEM);
+	sg_init_table(sglist, 1);
+	/* the carveout sits outside the memmap, so there is no page to set */
+	sg_dma_address(sglist) = buffer->priv_phys;
+	sg_dma_len(sglist) = buffer->size;
+	buffer->sg_cache = sglist;
+	return sglist;
 }
 
 void ion_carveout_heap_unmap_dma(struct ion_heap *heap,
 				 struct ion_buffer *buffer)
 {
+	/* the scatterlist is kept until the buffer is freed */
 	return;
 }
 
 void *ion_carveout_heap_map_kernel(struct ion_heap *heap,
 				   struct ion_buffer *buffer)
 {
+	/* MT_MEMORY_NONCACHED is normal uncached memory, which already
+	   buffers writes */
 	return __arch_ioremap(buffer->priv_phys, buffer->size,
-			      MT_MEMORY_NONCACHED);
+			      buffer->flags & ION_FLAG_CACHED ?
+			      MT_MEMORY : MT_MEMORY_NONCACHED);
 }
 
 void ion_carveout_heap_unmap_kernel(struct ion_heap *heap,
@@ -117,16 +244,21 @@ int ion_carveout_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 	return remap_pfn_range(vma, vma->vm_start,
 			       __phys_to_pfn(buffer->priv_phys) + vma->vm_pgoff,
 			       buffer->size,
-			       pgprot_noncached(vma->vm_page_prot));
+			       ion_buffer_pgprot(buffer, vma->vm_page_prot));
 }
 
 static struct ion_heap_ops carveout_heap_ops = {
 	.allocate = ion_carveout_heap_allocate,
 	.free = ion_carveout_heap_free,
 	.phys = ion_carveout_heap_phys,
+	.map_dma = ion_carveout_heap_map_dma,
+	.unmap_dma = ion_carveout_heap_unmap_dma,
 	.map_user = ion_carveout_heap_map_user,
 	.map_kernel = ion_carveout_heap_map_kernel,
 	.unmap_kernel = ion_carveout_heap_unmap_kernel,
+	.sync = ion_carveout_heap_sync,
+	.user_pfn = ion_carveout_heap_user_pfn,
+	.recycle = ion_carveout_heap_recycle,
 };
 
 struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *heap_data)
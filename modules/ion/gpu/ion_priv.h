@@ -18,12 +18,14 @@
 #define _ION_PRIV_H
 
 #include <linux/kref.h>
+#include <linux/list.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
 #include <linux/ion.h>
 
 struct ion_mapping;
+struct seq_file;
 
 struct ion_dma_mapping {
 	struct kref ref;
@@ -37,13 +39,36 @@ struct ion_kernel_mapping {
 
 struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
 
+/**
+ * ion_buffer_pgprot - page protection to map a buffer to userspace with
+ * @buffer:		the buffer
+ * @prot:		the vma's default page protection
+ *
+ * Picks cached, write-combined or uncached according to the ION_FLAG_*
+ * bits the buffer was allocated with.
+ */
+pgprot_t ion_buffer_pgprot(struct ion_buffer *buffer, pgprot_t prot);
+
+/**
+ * ion_buffer_set_size - set the size of a buffer after allocating it
+ * @client:		the client that allocated the buffer
+ * @handle:		the handle returned by ion_alloc
+ * @size:		the real size of the buffer
+ *
+ * For heaps such as the tiler that create the buffer through ion_alloc
+ * with a length of 0 and fill it in afterwards.  Keeps the client and heap
+ * accounting right, so must be called before the buffer is shared.
+ */
+void ion_buffer_set_size(struct ion_client *client, struct ion_handle *handle,
+			 size_t size);
+
 /**
  * struct ion_buffer - metadata for a particular buffer
  * @ref:		refernce count
  * @node:		node in the ion_device buffers tree
  * @dev:		back pointer to the ion_device
  * @heap:		back pointer to the heap the buffer came from
- * @flags:		buffer specific flags
+ * @flags:		flags the buffer was allocated with
  * @size:		size of the buffer
  * @priv_virt:		private data to the buffer representable as
  *			a void *
@@ -54,6 +79,11 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * @vaddr:		the kenrel mapping if kmap_cnt is not zero
  * @dmap_cnt:		number of times the buffer is mapped for dma
  * @sglist:		the scatterlist for the buffer is dmap_cnt is not zero
+ * @sg_cache:		scatterlist built by heaps whose dma mapping never
+ *			changes, kept across map_dma calls and freed by the
+ *			heap along with the buffer
+ * @cache_node:		node in the heap's buffer cache while the buffer is
+ *			free and waiting to be reused
 */
 struct ion_buffer {
 	struct kref ref;
@@ -71,6 +101,8 @@ struct ion_buffer {
 	void *vaddr;
 	int dmap_cnt;
 	struct scatterlist *sglist;
+	struct scatterlist *sg_cache;
+	struct list_head cache_node;
 };
 
 /**
@@ -84,6 +116,12 @@ struct ion_buffer {
  * @map_kernel		map memory to the kernel
  * @unmap_kernel	unmap memory to the kernel
  * @map_user		map memory to userspace
+ * @sync		cache maintenance over a range of the buffer
+ * @user_pfn		pfn backing a page of the buffer, heaps that define it
+ *			can be mapped to userspace lazily on fault
+ * @recycle		prepare a freed buffer to be handed out again, heaps
+ *			that define it opt in to the buffer cache
+ * @debug_show		print heap specific state to the heap's debugfs file
  */
 struct ion_heap_ops {
 	int (*allocate) (struct ion_heap *heap,
@@ -99,18 +137,73 @@ struct ion_heap_ops {
 	void (*unmap_kernel) (struct ion_heap *heap, struct ion_buffer *buffer);
 	int (*map_user) (struct ion_heap *mapper, struct ion_buffer *buffer,
 			 struct vm_area_struct *vma);
+	int (*sync) (struct ion_heap *heap, struct ion_buffer *buffer,
+		     size_t offset, size_t len, unsigned int op);
+	unsigned long (*user_pfn) (struct ion_heap *heap,
+				   struct ion_buffer *buffer,
+				   unsigned long pgoff);
+	void (*recycle) (struct ion_buffer *buffer);
+	void (*debug_show) (struct ion_heap *heap, struct seq_file *s);
+};
+
+/* heap ids are bit numbers in the allocation mask, below the ION_FLAG_ bits */
+#define ION_NUM_HEAP_IDS	29
+
+#define ION_LATENCY_BUCKETS	12
+
+/**
+ * struct ion_heap_stats - running accounting of a heap
+ * @bytes:		bytes in live buffers
+ * @buffers:		number of live buffers
+ * @peak_bytes:		highest value @bytes has reached
+ * @failures:		allocations the heap could not satisfy
+ * @latency:		allocations by time taken, bucket 0 counts those
+ *			under 1us, bucket i those under 2^i us and the last
+ *			bucket everything slower
+ *
+ * Protected by the lock of the heap it is embedded in.
+ */
+struct ion_heap_stats {
+	size_t bytes;
+	unsigned int buffers;
+	size_t peak_bytes;
+	unsigned long failures;
+	unsigned long latency[ION_LATENCY_BUCKETS];
+};
+
+#define ION_CACHE_BUCKETS	8
+
+/**
+ * struct ion_buffer_cache - freed buffers kept around for reuse
+ * @buckets:		freed buffers, bucketed by log2 of their page count
+ * @bytes:		memory held by the buffers in the buckets
+ * @hits:		allocations satisfied from the cache
+ * @misses:		allocations that fell through to the heap
+ * @node:		node in the list of caches walked by the shrinker
+ *
+ * Protected by the lock of the heap it is embedded in.
+ */
+struct ion_buffer_cache {
+	struct list_head buckets[ION_CACHE_BUCKETS];
+	size_t bytes;
+	unsigned long hits;
+	unsigned long misses;
+	struct list_head node;
 };
 
 /**
  * struct ion_heap - represents a heap in the system
  * @node:		rb node to put the heap on the device's tree of heaps
  * @dev:		back pointer to the ion_device
+ * @lock:		serializes the allocate and free ops of this heap
  * @type:		type of heap
  * @ops:		ops struct as above
  * @id:			id of heap, also indicates priority of this heap when
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @cache:		recently freed buffers, if the heap supports recycle
+ * @stats:		running usage counters, shown in debugfs
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -120,10 +213,13 @@ struct ion_heap_ops {
 struct ion_heap {
 	struct rb_node node;
 	struct ion_device *dev;
+	struct mutex lock;
 	enum ion_heap_type type;
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	struct ion_buffer_cache cache;
+	struct ion_heap_stats stats;
 };
 
 /**
@@ -173,6 +269,19 @@ void ion_carveout_heap_destroy(struct ion_heap *);
  */
 ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap, unsigned long size,
 				      unsigned long align);
+/**
+ * ion_carveout_allocate_extent - allocate up to size bytes from carveout
+ * @heap:		the carveout heap
+ * @size:		number of bytes wanted
+ * @alloc_size:		set to the number of bytes allocated, which may be
+ *			less than @size if no free range is that large
+ *
+ * Returns the largest contiguous range available up to @size, for backing
+ * allocations that can be made of several pieces.
+ */
+ion_phys_addr_t ion_carveout_allocate_extent(struct ion_heap *heap,
+					     unsigned long size,
+					     unsigned long *alloc_size);
 void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 		       unsigned long size);
 /**
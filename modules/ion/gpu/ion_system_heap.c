@@ -38,6 +38,12 @@ void ion_system_heap_free(struct ion_buffer *buffer)
 	vfree(buffer->priv_virt);
 }
 
+static void ion_system_heap_recycle(struct ion_buffer *buffer)
+{
+	/* vmalloc_user hands out zeroed memory, so must we */
+	memset(buffer->priv_virt, 0, PAGE_ALIGN(buffer->size));
+}
+
 struct scatterlist *ion_system_heap_map_dma(struct ion_heap *heap,
 					    struct ion_buffer *buffer)
 {
@@ -99,6 +105,7 @@ static struct ion_heap_ops vmalloc_ops = {
 	.map_kernel = ion_system_heap_map_kernel,
 	.unmap_kernel = ion_system_heap_unmap_kernel,
 	.map_user = ion_system_heap_map_user,
+	.recycle = ion_system_heap_recycle,
 };
 
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
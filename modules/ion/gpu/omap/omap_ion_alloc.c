@@ -26,10 +26,14 @@
 
 #ifdef CONFIG_OMAP2_VRFB
 
+#include <linux/hash.h>
 #include <plat/vrfb.h>
 #include "../ion_priv.h"
 
 #define VRFB_NUM_SLOTS	12
+/* setups still on screen or queued to DSS: shown and pending, two overlays */
+#define VRFB_IN_FLIGHT	4
+#define VRFB_HASH_BITS	4
 #define VRFB_LINE_LENGTH 2048
 
 /*
@@ -46,8 +50,14 @@ struct ion_vrfb {
 	struct vrfb vrfb_context;
 	__u32 ba;
 	__u8 ismapped;
+	__u8 hash_next;			/* next slot + 1 in the chain, 0 ends it */
+	unsigned long last_used;	/* vrfb_clock when last set up, 0 never */
 } ion_vrfb_t[VRFB_NUM_SLOTS];
 
+/* slots in use are chained by a hash of ba, heads are first slot + 1 */
+static __u8 vrfb_hash[1 << VRFB_HASH_BITS];
+static unsigned long vrfb_clock;
+
 #endif
 
 #define BITS_PER_PIXEL  8
@@ -88,56 +98,125 @@ int omap_ion_get_pages(struct ion_client *client, struct ion_handle *handle,
 
 #ifdef CONFIG_OMAP2_VRFB
 
-void omap_free_vrfb_buffer(__u32 paddr)
+static int vrfb_lookup(__u32 ba)
 {
-	int j = 0;
+	int i = vrfb_hash[hash_32(ba, VRFB_HASH_BITS)] - 1;
 
-	if (!have_vrfb_ctx)
-		return;
+	while (i >= 0 && ion_vrfb_t[i].ba != ba)
+		i = ion_vrfb_t[i].hash_next - 1;
+	return i;
+}
 
-	for (j = 0; j < VRFB_NUM_SLOTS; j++) {
-		if (ion_vrfb_t[j].ba == paddr) {
-			omap_vrfb_release_ctx(&ion_vrfb_t[j].vrfb_context);
-			ion_vrfb_t[j].ba = 0;
-			ion_vrfb_t[j].ismapped = 0;
-			have_vrfb_ctx--;
-			break;
-		}
-	}
+static void vrfb_hash_add(int i)
+{
+	__u8 *head = &vrfb_hash[hash_32(ion_vrfb_t[i].ba, VRFB_HASH_BITS)];
 
+	ion_vrfb_t[i].hash_next = *head;
+	*head = i + 1;
 }
 
-void omap_get_vrfb_buffer(__u32 paddr)
+static void vrfb_hash_del(int i)
 {
-	int i = 0;
-	int j = 0;
+	__u8 *p = &vrfb_hash[hash_32(ion_vrfb_t[i].ba, VRFB_HASH_BITS)];
 
-	if (have_vrfb_ctx >= VRFB_NUM_SLOTS)
-		return;
+	while (*p != i + 1)
+		p = &ion_vrfb_t[*p - 1].hash_next;
+	*p = ion_vrfb_t[i].hash_next;
+}
+
+/*
+ * DSS doesn't tell us when it is done with a buffer, so the contexts of the
+ * last VRFB_IN_FLIGHT setups are taken to be scanned out or queued.
+ */
+static int vrfb_in_flight(int i)
+{
+	return ion_vrfb_t[i].last_used &&
+	       vrfb_clock - ion_vrfb_t[i].last_used < VRFB_IN_FLIGHT;
+}
+
+/*
+ * The slot in use that was set up longest ago, slots never set up first,
+ * skipping the ones in flight.  Should they all be (fewer contexts than
+ * VRFB_IN_FLIGHT), the oldest one goes anyway, it is the likeliest to be
+ * off screen already and a claim must not fail for good.  Returns -1 if
+ * no slot is in use.
+ */
+static int vrfb_lru_slot(void)
+{
+	int i, lru = -1, idle = -1;
 
 	for (i = 0; i < VRFB_NUM_SLOTS; i++) {
-		if (ion_vrfb_t[i].ba == 0) {
-			if (omap_vrfb_request_ctx
-				(&ion_vrfb_t[i].vrfb_context)) {
-				pr_err("%s:VRFB allocation failed\n", __func__);
-				for (j = 0; j < VRFB_NUM_SLOTS; j++)
-					if (ion_vrfb_t[j].ba) {
-						omap_vrfb_release_ctx(
-						&ion_vrfb_t[j].vrfb_context);
-						ion_vrfb_t[j].ba = 0;
-						ion_vrfb_t[j].ismapped = 0;
-						have_vrfb_ctx--;
-				}
-			return ;
-			}
-			ion_vrfb_t[i].ba = paddr;
-			ion_vrfb_t[i].ismapped = 0;
+		if (!ion_vrfb_t[i].ba)
+			continue;
+		if (lru < 0 || ion_vrfb_t[i].last_used <
+			       ion_vrfb_t[lru].last_used)
+			lru = i;
+		if (!vrfb_in_flight(i) && (idle < 0 ||
+		    ion_vrfb_t[i].last_used < ion_vrfb_t[idle].last_used))
+			idle = i;
+	}
+	return idle >= 0 ? idle : lru;
+}
+
+/*
+ * Returns the slot bound to paddr, binding a free one if there is none.
+ * When the slots or the VRFB contexts run out, the least recently mapped
+ * slot that is not in flight is handed over along with its context, rather
+ * than releasing every context and making all of them go through
+ * omap_vrfb_setup again.  The buffer losing it gets one back at its next
+ * omap_setup_vrfb_buffer.
+ */
+static int omap_vrfb_claim(__u32 paddr)
+{
+	int i = vrfb_lookup(paddr);
+
+	if (i >= 0)
+		return i;
+
+	if (have_vrfb_ctx < VRFB_NUM_SLOTS) {
+		for (i = 0; ion_vrfb_t[i].ba; i++)
+			;
+		if (!omap_vrfb_request_ctx(&ion_vrfb_t[i].vrfb_context)) {
 			have_vrfb_ctx++;
-			break;
+			goto bind;
 		}
+		pr_err("%s:VRFB allocation failed\n", __func__);
 	}
 
-	return;
+	i = vrfb_lru_slot();
+	if (i < 0)
+		return -1;
+	vrfb_hash_del(i);
+bind:
+	ion_vrfb_t[i].ba = paddr;
+	ion_vrfb_t[i].ismapped = 0;
+	ion_vrfb_t[i].last_used = 0;
+	vrfb_hash_add(i);
+	return i;
+}
+
+void omap_free_vrfb_buffer(__u32 paddr)
+{
+	int j;
+
+	if (!have_vrfb_ctx)
+		return;
+
+	j = vrfb_lookup(paddr);
+	if (j < 0)
+		return;
+
+	omap_vrfb_release_ctx(&ion_vrfb_t[j].vrfb_context);
+	vrfb_hash_del(j);
+	ion_vrfb_t[j].ba = 0;
+	ion_vrfb_t[j].ismapped = 0;
+	have_vrfb_ctx--;
+}
+
+void omap_get_vrfb_buffer(__u32 paddr)
+{
+	if (omap_vrfb_claim(paddr) < 0)
+		pr_err("%s: No VRFB context available\n", __func__);
 }
 
 static int get_bpp(int color_mode)
@@ -244,30 +323,26 @@ int omap_setup_vrfb_buffer(struct dss2_ovl_info *ovl_info)
 	int mode = ovl_info->cfg.color_mode;
 	int got_vrfb_mapped_buf = 0;
 
-	if (!have_vrfb_ctx) {
+	/* normally bound by omap_get_vrfb_buffer, but the slot may have
+	   been handed to another buffer since */
+	i = omap_vrfb_claim(ovl_info->ba);
+	if (i < 0) {
 		pr_err("%s: No VRFB context available for setup\n", __func__);
 		return 1;
 	}
+	ion_vrfb_t[i].last_used = ++vrfb_clock;
 
-	for (i = 0; i < VRFB_NUM_SLOTS; i++) {
-		if (ion_vrfb_t[i].ba == ovl_info->ba) {
-			if (ion_vrfb_t[i].ismapped) {
-				if (check_vrfb_params(
-					&ion_vrfb_t[i].vrfb_context,
-					ovl_info)) {
-					got_vrfb_mapped_buf = 0;
-					ion_vrfb_t[i].ismapped = 0;
-				} else {
-					ovl_info->ba = ion_vrfb_t[i].
-						vrfb_context.
-						paddr[ovl_info->cfg.rotation]
-						+ omap_get_vrfb_offset(
-						&ion_vrfb_t[i].vrfb_context,
-						ovl_info->cfg.rotation);
-				got_vrfb_mapped_buf = 1;
-				}
-			}
-			break;
+	if (ion_vrfb_t[i].ismapped) {
+		if (check_vrfb_params(&ion_vrfb_t[i].vrfb_context, ovl_info)) {
+			got_vrfb_mapped_buf = 0;
+			ion_vrfb_t[i].ismapped = 0;
+		} else {
+			ovl_info->ba = ion_vrfb_t[i].
+				vrfb_context.paddr[ovl_info->cfg.rotation]
+				+ omap_get_vrfb_offset(
+				&ion_vrfb_t[i].vrfb_context,
+				ovl_info->cfg.rotation);
+			got_vrfb_mapped_buf = 1;
 		}
 	}
 
@@ -20,8 +20,10 @@
 #include <linux/io.h>
 #include <linux/ion.h>
 #include <linux/mm.h>
+#include <linux/moduleparam.h>
 #include <linux/omap_ion.h>
 #include <linux/scatterlist.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include "mach/tiler.h"
@@ -46,7 +48,6 @@ static int omap_tiler_heap_allocate(struct ion_heap *heap,
 
 struct omap_tiler_info {
 	tiler_blk_handle tiler_handle;	/* handle of the allocation intiler */
-	bool lump;			/* true for a single lump allocation */
 	u32 n_phys_pages;		/* number of physical pages */
 	u32 *phys_addrs;		/* array addrs of pages */
 	u32 n_tiler_pages;		/* number of tiler pages */
@@ -54,8 +55,166 @@ struct omap_tiler_info {
 	u32 tiler_start;		/* start addr in tiler -- if not page
 					   aligned this may not equal the
 					   first entry onf tiler_addrs */
+	struct scatterlist *sglist;	/* contiguous runs of tiler_addrs,
+					   built on the first map_dma */
+	struct ion_heap *heap;		/* heap the block came from */
+	u32 fmt, w, h;			/* geometry it was allocated for */
+	struct list_head cache_node;	/* node in tiler_cache while freed */
 };
 
+/*
+ * Decoders reallocate the same buffer geometries at every seek and session
+ * restart.  Up to tiler_cache_blocks freed blocks are kept with their
+ * container and backing pages still pinned, and an allocation of the same
+ * format and size takes one back instead of searching for a container and
+ * pinning pages again.  Cached blocks are evicted, oldest first, when the
+ * limit is exceeded or lowered, whenever the tiler or the carveout runs out
+ * and when the shrinker asks for memory back.
+ */
+static unsigned int tiler_cache_blocks;
+
+static LIST_HEAD(tiler_cache);
+static DEFINE_MUTEX(tiler_cache_lock);
+static unsigned int tiler_cache_count;
+static unsigned long tiler_cache_pages;
+static unsigned int tiler_heaps;
+static unsigned long tiler_cache_hits;
+static unsigned long tiler_cache_misses;
+
+/*
+ * Frees the backing pages in one pass, a call per physically contiguous
+ * run rather than per page.  Neighbouring extents may be freed together,
+ * the carveout only tracks which pages are in use.
+ */
+static void omap_tiler_free_pages(struct ion_heap *heap, u32 *phys_addrs,
+				  int n_pages)
+{
+	int i, run;
+
+	for (i = 0; i < n_pages; i += run) {
+		for (run = 1; i + run < n_pages; run++)
+			if (phys_addrs[i + run] !=
+			    phys_addrs[i] + run * PAGE_SIZE)
+				break;
+		ion_carveout_free(heap, phys_addrs[i], run * PAGE_SIZE);
+	}
+}
+
+static void omap_tiler_release(struct omap_tiler_info *info)
+{
+	tiler_unpin_block(info->tiler_handle);
+	tiler_free_block_area(info->tiler_handle);
+	kfree(info->sglist);
+	omap_tiler_free_pages(info->heap, info->phys_addrs,
+			      info->n_phys_pages);
+	kfree(info);
+}
+
+static struct omap_tiler_info *omap_tiler_cache_get(struct ion_heap *heap,
+				struct omap_ion_tiler_alloc_data *data)
+{
+	struct omap_tiler_info *info;
+
+	mutex_lock(&tiler_cache_lock);
+	list_for_each_entry(info, &tiler_cache, cache_node) {
+		if (info->heap == heap && info->fmt == data->fmt &&
+		    info->w == data->w && info->h == data->h) {
+			list_del(&info->cache_node);
+			tiler_cache_count--;
+			tiler_cache_pages -= info->n_phys_pages;
+			tiler_cache_hits++;
+			mutex_unlock(&tiler_cache_lock);
+			return info;
+		}
+	}
+	if (tiler_cache_blocks)
+		tiler_cache_misses++;
+	mutex_unlock(&tiler_cache_lock);
+	return NULL;
+}
+
+/*
+ * Releases cached blocks, oldest first, until no more than keep remain.
+ * If heap is set only its blocks are released.  Returns the number of
+ * blocks released.  Called with tiler_cache_lock held.
+ */
+static int omap_tiler_cache_evict(struct ion_heap *heap, unsigned int keep)
+{
+	struct omap_tiler_info *info, *tmp;
+	int released = 0;
+
+	list_for_each_entry_safe_reverse(info, tmp, &tiler_cache, cache_node) {
+		if (tiler_cache_count <= keep)
+			break;
+		if (heap && info->heap != heap)
+			continue;
+		list_del(&info->cache_node);
+		tiler_cache_count--;
+		tiler_cache_pages -= info->n_phys_pages;
+		omap_tiler_release(info);
+		released++;
+	}
+	return released;
+}
+
+static int omap_tiler_cache_set_blocks(const char *val, struct kernel_param *kp)
+{
+	int ret = param_set_uint(val, kp);
+
+	if (ret)
+		return ret;
+
+	mutex_lock(&tiler_cache_lock);
+	omap_tiler_cache_evict(NULL, tiler_cache_blocks);
+	mutex_unlock(&tiler_cache_lock);
+	return 0;
+}
+
+module_param_call(tiler_cache_blocks, omap_tiler_cache_set_blocks,
+		  param_get_uint, &tiler_cache_blocks, 0644);
+MODULE_PARM_DESC(tiler_cache_blocks,
+		 "freed tiler blocks kept pinned for reuse (0 disables)");
+
+/* 2.6.32 shrinker interface, counts in backing pages */
+static int omap_tiler_cache_shrink_all(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct omap_tiler_info *info, *tmp;
+	int count;
+
+	/* tiler_cache_lock is held across omap_tiler_release, never wait */
+	if (!mutex_trylock(&tiler_cache_lock))
+		return nr_to_scan ? -1 : 0;
+
+	list_for_each_entry_safe_reverse(info, tmp, &tiler_cache, cache_node) {
+		if (nr_to_scan <= 0)
+			break;
+		list_del(&info->cache_node);
+		tiler_cache_count--;
+		tiler_cache_pages -= info->n_phys_pages;
+		nr_to_scan -= info->n_phys_pages;
+		omap_tiler_release(info);
+	}
+	count = tiler_cache_pages;
+	mutex_unlock(&tiler_cache_lock);
+	return count;
+}
+
+static struct shrinker omap_tiler_cache_shrinker = {
+	.shrink = omap_tiler_cache_shrink_all,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/* drop this heap's cached blocks, to make room for a failed allocation */
+static int omap_tiler_cache_shrink(struct ion_heap *heap)
+{
+	int released;
+
+	mutex_lock(&tiler_cache_lock);
+	released = omap_tiler_cache_evict(heap, 0);
+	mutex_unlock(&tiler_cache_lock);
+	return released;
+}
+
 int omap_tiler_alloc(struct ion_heap *heap,
 		     struct ion_client *client,
 		     struct omap_ion_tiler_alloc_data *data)
@@ -86,6 +245,10 @@ int omap_tiler_alloc(struct ion_heap *heap,
 
 	BUG_ON(!n_phys_pages || !n_tiler_pages);
 
+	info = omap_tiler_cache_get(heap, data);
+	if (info)
+		goto pinned;
+
 	info = kzalloc(sizeof(struct omap_tiler_info) +
 		       sizeof(u32) * n_phys_pages +
 		       sizeof(u32) * n_tiler_pages, GFP_KERNEL);
@@ -96,10 +259,20 @@ int omap_tiler_alloc(struct ion_heap *heap,
 	info->n_tiler_pages = n_tiler_pages;
 	info->phys_addrs = (u32 *)(info + 1);
 	info->tiler_addrs = info->phys_addrs + n_phys_pages;
+	info->heap = heap;
+	info->fmt = data->fmt;
+	info->w = data->w;
+	info->h = data->h;
 
 	info->tiler_handle = tiler_alloc_block_area(data->fmt, data->w, data->h,
 						    &info->tiler_start,
 						    info->tiler_addrs);
+	if (IS_ERR_OR_NULL(info->tiler_handle) &&
+	    omap_tiler_cache_shrink(heap))
+		info->tiler_handle = tiler_alloc_block_area(data->fmt, data->w,
+							    data->h,
+							    &info->tiler_start,
+							    info->tiler_addrs);
 	if (IS_ERR_OR_NULL(info->tiler_handle)) {
 		ret = PTR_ERR(info->tiler_handle);
 		pr_err("%s: failure to allocate address space from tiler\n",
@@ -108,20 +281,26 @@ int omap_tiler_alloc(struct ion_heap *heap,
 	}
 
 	addr = ion_carveout_allocate(heap, n_phys_pages*PAGE_SIZE, 0);
+	if (addr == ION_CARVEOUT_ALLOCATE_FAIL && omap_tiler_cache_shrink(heap))
+		addr = ion_carveout_allocate(heap, n_phys_pages*PAGE_SIZE, 0);
 	if (addr == ION_CARVEOUT_ALLOCATE_FAIL) {
-		for (i = 0; i < n_phys_pages; i++) {
-			addr = ion_carveout_allocate(heap, PAGE_SIZE, 0);
+		/* no single lump, back the block with the largest extents
+		   left rather than page by page */
+		for (i = 0; i < n_phys_pages; ) {
+			unsigned long len;
 
+			addr = ion_carveout_allocate_extent(heap,
+					(n_phys_pages - i) * PAGE_SIZE, &len);
 			if (addr == ION_CARVEOUT_ALLOCATE_FAIL) {
 				ret = -ENOMEM;
 				pr_err("%s: failed to allocate pages to back "
 					"tiler address space\n", __func__);
 				goto err_alloc;
 			}
-			info->phys_addrs[i] = addr;
+			for (; len; len -= PAGE_SIZE, addr += PAGE_SIZE)
+				info->phys_addrs[i++] = addr;
 		}
 	} else {
-		info->lump = true;
 		for (i = 0; i < n_phys_pages; i++)
 			info->phys_addrs[i] = addr + i*PAGE_SIZE;
 	}
@@ -133,6 +312,7 @@ int omap_tiler_alloc(struct ion_heap *heap,
 		goto err_alloc;
 	}
 
+pinned:
 	data->stride = tiler_block_vstride(info->tiler_handle);
 
 	/* create an ion handle  for the allocation */
@@ -141,24 +321,19 @@ int omap_tiler_alloc(struct ion_heap *heap,
 		ret = PTR_ERR(handle);
 		pr_err("%s: failure to allocate handle to manage tiler"
 		       " allocation\n", __func__);
-		goto err;
+		omap_tiler_release(info);
+		return ret;
 	}
 
 	buffer = ion_handle_buffer(handle);
-	buffer->size = info->n_tiler_pages * PAGE_SIZE;
+	ion_buffer_set_size(client, handle, info->n_tiler_pages * PAGE_SIZE);
 	buffer->priv_virt = info;
 	data->handle = handle;
 	return 0;
 
-err:
-	tiler_unpin_block(info->tiler_handle);
 err_alloc:
 	tiler_free_block_area(info->tiler_handle);
-	if (info->lump)
-		ion_carveout_free(heap, addr, n_phys_pages * PAGE_SIZE);
-	else
-		for (i -= 1; i >= 0; i--)
-			ion_carveout_free(heap, info->phys_addrs[i], PAGE_SIZE);
+	omap_tiler_free_pages(heap, info->phys_addrs, i);
 err_nomem:
 	kfree(info);
 	return ret;
@@ -168,20 +343,30 @@ void omap_tiler_heap_free(struct ion_buffer *buffer)
 {
 	struct omap_tiler_info *info = buffer->priv_virt;
 
-	tiler_unpin_block(info->tiler_handle);
-	tiler_free_block_area(info->tiler_handle);
-
-	if (info->lump) {
-		ion_carveout_free(buffer->heap, info->phys_addrs[0],
-				  info->n_phys_pages*PAGE_SIZE);
-	} else {
-		int i;
-		for (i = 0; i < info->n_phys_pages; i++)
-			ion_carveout_free(buffer->heap,
-					  info->phys_addrs[i], PAGE_SIZE);
+	/* the handle failed to be set up, omap_tiler_alloc cleans up */
+	if (!info)
+		return;
+
+	if (tiler_cache_blocks) {
+		mutex_lock(&tiler_cache_lock);
+		list_add(&info->cache_node, &tiler_cache);
+		tiler_cache_count++;
+		tiler_cache_pages += info->n_phys_pages;
+		omap_tiler_cache_evict(NULL, tiler_cache_blocks);
+		mutex_unlock(&tiler_cache_lock);
+		return;
 	}
+	omap_tiler_release(info);
+}
 
-	kfree(info);
+static void omap_tiler_heap_debug_show(struct ion_heap *heap,
+				       struct seq_file *s)
+{
+	mutex_lock(&tiler_cache_lock);
+	seq_printf(s, "\ntiler cache: %u blocks, %lu pages, %lu hits, "
+		   "%lu misses\n", tiler_cache_count, tiler_cache_pages,
+		   tiler_cache_hits, tiler_cache_misses);
+	mutex_unlock(&tiler_cache_lock);
 }
 
 static int omap_tiler_phys(struct ion_heap *heap,
@@ -213,6 +398,61 @@ int omap_tiler_pages(struct ion_client *client, struct ion_handle *handle,
 	return 0;
 }
 
+/* number of physically contiguous pages starting at tiler_addrs[i] */
+static int omap_tiler_run(struct omap_tiler_info *info, int i, int n_pages)
+{
+	int run;
+
+	for (run = 1; i + run < n_pages; run++)
+		if (info->tiler_addrs[i + run] !=
+		    info->tiler_addrs[i] + run * PAGE_SIZE)
+			break;
+	return run;
+}
+
+/*
+ * The tiler view has no struct pages behind it, so the entries only carry
+ * the dma address and length, one per contiguous run.  The layout is fixed
+ * once the block is pinned, so the list is built once and kept until the
+ * buffer is freed.
+ */
+static struct scatterlist *omap_tiler_heap_map_dma(struct ion_heap *heap,
+						   struct ion_buffer *buffer)
+{
+	struct omap_tiler_info *info = buffer->priv_virt;
+	struct scatterlist *sg;
+	int i, n_runs = 0;
+
+	if (info->sglist)
+		return info->sglist;
+
+	for (i = 0; i < info->n_tiler_pages; i += omap_tiler_run(info, i,
+						info->n_tiler_pages))
+		n_runs++;
+
+	info->sglist = kmalloc(n_runs * sizeof(struct scatterlist),
+			       GFP_KERNEL);
+	if (!info->sglist)
+		return ERR_PTR(-ENOMEM);
+	sg_init_table(info->sglist, n_runs);
+
+	for (i = 0, sg = info->sglist; i < info->n_tiler_pages;
+	     sg = sg_next(sg)) {
+		int run = omap_tiler_run(info, i, info->n_tiler_pages);
+
+		sg_dma_address(sg) = info->tiler_addrs[i];
+		sg->length = run * PAGE_SIZE;
+		i += run;
+	}
+	return info->sglist;
+}
+
+static void omap_tiler_heap_unmap_dma(struct ion_heap *heap,
+				      struct ion_buffer *buffer)
+{
+	/* the scatterlist is kept until the buffer is freed */
+}
+
 int omap_tiler_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 			     struct vm_area_struct *vma)
 {
@@ -220,24 +460,47 @@ int omap_tiler_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 	unsigned long addr = vma->vm_start;
 	u32 vma_pages = (vma->vm_end - vma->vm_start) / PAGE_SIZE;
 	int n_pages = min(vma_pages, info->n_tiler_pages);
-	int i, ret;
+	int i, run, ret;
+
+	for (i = vma->vm_pgoff; i < n_pages; i += run) {
+		/*
+		 * 1D blocks and the rows of 2D blocks are contiguous in the
+		 * tiler address space, map each contiguous run in one go
+		 * rather than page by page
+		 */
+		run = omap_tiler_run(info, i, n_pages);
 
-	for (i = vma->vm_pgoff; i < n_pages; i++, addr += PAGE_SIZE) {
+		/* same attributes as ion_vma_fault maps it with */
 		ret = remap_pfn_range(vma, addr,
 				      __phys_to_pfn(info->tiler_addrs[i]),
-				      PAGE_SIZE,
-				      pgprot_noncached(vma->vm_page_prot));
+				      run * PAGE_SIZE,
+				      ion_buffer_pgprot(buffer,
+							vma->vm_page_prot));
 		if (ret)
 			return ret;
+		addr += run * PAGE_SIZE;
 	}
 	return 0;
 }
 
+unsigned long omap_tiler_heap_user_pfn(struct ion_heap *heap,
+				       struct ion_buffer *buffer,
+				       unsigned long pgoff)
+{
+	struct omap_tiler_info *info = buffer->priv_virt;
+
+	return __phys_to_pfn(info->tiler_addrs[pgoff]);
+}
+
 static struct ion_heap_ops omap_tiler_ops = {
 	.allocate = omap_tiler_heap_allocate,
 	.free = omap_tiler_heap_free,
 	.phys = omap_tiler_phys,
+	.map_dma = omap_tiler_heap_map_dma,
+	.unmap_dma = omap_tiler_heap_unmap_dma,
 	.map_user = omap_tiler_heap_map_user,
+	.user_pfn = omap_tiler_heap_user_pfn,
+	.debug_show = omap_tiler_heap_debug_show,
 };
 
 struct ion_heap *omap_tiler_heap_create(struct ion_platform_heap *data)
@@ -251,10 +514,22 @@ struct ion_heap *omap_tiler_heap_create(struct ion_platform_heap *data)
 	heap->type = OMAP_ION_HEAP_TYPE_TILER;
 	heap->name = data->name;
 	heap->id = data->id;
+
+	/* the block cache is shared by the tiler heaps, so is its shrinker */
+	mutex_lock(&tiler_cache_lock);
+	if (!tiler_heaps++)
+		register_shrinker(&omap_tiler_cache_shrinker);
+	mutex_unlock(&tiler_cache_lock);
 	return heap;
 }
 
 void omap_tiler_heap_destroy(struct ion_heap *heap)
 {
+	/* cached blocks still hold tiler areas and carveout extents */
+	omap_tiler_cache_shrink(heap);
+	mutex_lock(&tiler_cache_lock);
+	if (!--tiler_heaps)
+		unregister_shrinker(&omap_tiler_cache_shrinker);
+	mutex_unlock(&tiler_cache_lock);
 	kfree(heap);
 }
@@ -45,6 +45,23 @@ enum ion_heap_type {
 #define ION_HEAP_SYSTEM_CONTIG_MASK	(1 << ION_HEAP_TYPE_SYSTEM_CONTIG)
 #define ION_HEAP_CARVEOUT_MASK		(1 << ION_HEAP_TYPE_CARVEOUT)
 
+/*
+ * The low bits of the flags passed to ion_alloc are the mask of heap ids to
+ * allocate from, these high bits select how heaps that support it map the
+ * buffer.  Without either the buffer is mapped uncached, and so it is with
+ * both, so that an all-ones mask meaning "any heap" keeps the default.
+ * Heap ids stop below the first flag bit.
+ */
+#define ION_FLAG_CACHED			(1 << 30)
+#define ION_FLAG_WRITECOMBINE		(1 << 29)
+#define ION_FLAG_MAPPING_MASK		(ION_FLAG_CACHED | ION_FLAG_WRITECOMBINE)
+#define ION_HEAP_ID_MASK		((1 << 29) - 1)
+
+/* cache maintenance operations for ion_sync and ION_IOC_SYNC */
+#define ION_SYNC_CLEAN			0
+#define ION_SYNC_INVALIDATE		1
+#define ION_SYNC_FLUSH			2
+
 #ifdef __KERNEL__
 struct ion_device;
 struct ion_heap;
@@ -122,6 +139,22 @@ void ion_client_destroy(struct ion_client *client);
 struct ion_handle *ion_alloc(struct ion_client *client, size_t len,
 			     size_t align, unsigned int flags);
 
+/**
+ * ion_alloc_batch - allocate several ion buffers of the same spec
+ * @client:	the client
+ * @len:	size of each allocation
+ * @align:	requested alignment of each allocation
+ * @flags:	mask of heaps to allocate from, as for ion_alloc
+ * @count:	number of buffers to allocate
+ * @handles:	array of @count handles populated on success
+ *
+ * Either all @count buffers are allocated and their handles returned, or
+ * nothing is allocated and a negative error is returned.
+ */
+int ion_alloc_batch(struct ion_client *client, size_t len, size_t align,
+		    unsigned int flags, unsigned int count,
+		    struct ion_handle **handles);
+
 /**
  * ion_free - free a handle
  * @client:	the client
@@ -184,6 +217,22 @@ struct scatterlist *ion_map_dma(struct ion_client *client,
  */
 void ion_unmap_dma(struct ion_client *client, struct ion_handle *handle);
 
+/**
+ * ion_sync() - cache maintenance over a range of a buffer
+ * @client:	the client
+ * @handle:	handle to the buffer
+ * @offset:	start of the range, in bytes from the start of the buffer
+ * @len:	length of the range in bytes
+ * @op:		ION_SYNC_CLEAN before a device reads what the cpu wrote,
+ *		ION_SYNC_INVALIDATE before the cpu reads what a device wrote,
+ *		ION_SYNC_FLUSH for both
+ *
+ * Only needed for buffers allocated with ION_FLAG_CACHED, a no-op for
+ * buffers mapped uncached or write-combined.
+ */
+int ion_sync(struct ion_client *client, struct ion_handle *handle,
+	     size_t offset, size_t len, unsigned int op);
+
 /**
  * ion_share() - given a handle, obtain a buffer to pass to other clients
  * @client:	the client
@@ -252,6 +301,28 @@ struct ion_allocation_data {
 	struct ion_handle *handle;
 };
 
+/**
+ * struct ion_allocation_batch_data - metadata passed from userspace for
+ *				      allocating several buffers at once
+ * @len:	size of each allocation
+ * @align:	required alignment of each allocation
+ * @flags:	flags passed to heap
+ * @count:	number of buffers to allocate, at most ION_ALLOC_BATCH_MAX
+ * @handles:	array of @count handles that will be populated with cookies
+ *		to use to refer to the allocations
+ *
+ * Provided by userspace as an argument to the ioctl
+ */
+struct ion_allocation_batch_data {
+	size_t len;
+	size_t align;
+	unsigned int flags;
+	unsigned int count;
+	struct ion_handle **handles;
+};
+
+#define ION_ALLOC_BATCH_MAX	32
+
 /**
  * struct ion_fd_data - metadata passed to/from userspace for a handle/fd pair
  * @handle:	a handle
@@ -275,6 +346,20 @@ struct ion_handle_data {
 	struct ion_handle *handle;
 };
 
+/**
+ * struct ion_sync_data - a range of a buffer to perform cache maintenance on
+ * @handle:	the buffer
+ * @offset:	start of the range, in bytes from the start of the buffer
+ * @len:	length of the range in bytes
+ * @op:		ION_SYNC_CLEAN, ION_SYNC_INVALIDATE or ION_SYNC_FLUSH
+ */
+struct ion_sync_data {
+	struct ion_handle *handle;
+	size_t offset;
+	size_t len;
+	unsigned int op;
+};
+
 /**
  * struct ion_custom_data - metadata passed to/from userspace for a custom ioctl
  * @cmd:	the custom ioctl function to call
@@ -364,4 +449,23 @@ struct ion_map_gralloc_to_ionhandle_data {
 #define ION_IOC_MAP_GRALLOC	_IOWR(ION_IOC_MAGIC, 7, \
 				struct ion_map_gralloc_to_ionhandle_data)
 
+/**
+ * DOC: ION_IOC_ALLOC_BATCH - allocate several buffers at once
+ *
+ * Takes an ion_allocation_batch_data struct and fills the array it points
+ * to with the opaque handles of the allocations.  Either every buffer is
+ * allocated or the ioctl fails and none are.
+ */
+#define ION_IOC_ALLOC_BATCH	_IOWR(ION_IOC_MAGIC, 8, \
+				      struct ion_allocation_batch_data)
+
+/**
+ * DOC: ION_IOC_SYNC - cache maintenance over a range of a buffer
+ *
+ * Takes an ion_sync_data struct and cleans, invalidates or flushes the
+ * cpu caches over the given range.  Needed around device access to buffers
+ * allocated with ION_FLAG_CACHED.
+ */
+#define ION_IOC_SYNC		_IOWR(ION_IOC_MAGIC, 9, struct ion_sync_data)
+
 #endif /* _LINUX_ION_H */
@@ -27,6 +27,7 @@
 #include <linux/module.h>
 #include <linux/kallsyms.h>
 #include <linux/smp_lock.h>
+#include <asm/cacheflush.h>
 
 //FIX ME (dynamic module name)
 #define MODULE_NAME "ionpvr"
@@ -80,14 +81,24 @@ int hook(struct hook_info *hi) {
 	hi->target_cont = hi->target+1;
 	P("&invoke = %p, target_cont = %p\n", &hi->asm0, hi->target_cont);
 
+	// Both the patched target and the trampoline are executed as code.
+	flush_icache_range((unsigned long)hi->target,
+			   (unsigned long)(hi->target + 1));
+	flush_icache_range((unsigned long)&hi->asm0,
+			   (unsigned long)(&hi->target_cont + 1));
+	hi->hooked = 1;
+
 	INFO("hooked %s\n", ptargetName);
 	return 0;
 }
 
 int unhook(struct hook_info *hi) {
-	if ( hi->target ) {
+	if ( hi->target && hi->hooked ) {
 		// Restore the first 2 instructions to target.
 		hi->target[0] = hi->asm0;
+		flush_icache_range((unsigned long)hi->target,
+				   (unsigned long)(hi->target + 1));
+		hi->hooked = 0;
 		INFO("unhooked %p\n", hi->target);
 	}
 	return 0;
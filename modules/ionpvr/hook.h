@@ -29,6 +29,7 @@ struct hook_info {
 	unsigned int *target;
 	char *targetName;
 	unsigned int newfunc;
+	int hooked;
 };
 
 int hook(struct hook_info *);
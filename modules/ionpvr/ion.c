@@ -44,6 +44,10 @@
 #include <linux/fs.h>
 #include <linux/mutex.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
 
 //#include "../../misc/symsearch/symsearch.h"
 #include "../symsearch/symsearch.h"
@@ -58,7 +62,7 @@ SYMSEARCH_DECLARE_FUNCTION_STATIC(PVRSRV_ERROR, _PVRSRVPerProcessDataDeInit, IMG
 
 #include "hook.h"
 
-static struct mutex mlock;
+static DEFINE_MUTEX(mlock);
 #define LinuxLockMutex(m) mutex_lock(&mlock)
 #define LinuxUnLockMutex(m) mutex_unlock(&mlock)
 
@@ -75,6 +79,101 @@ static bool datainit = false;
 struct ion_client *gpsIONClient;
 EXPORT_SYMBOL(gpsIONClient);
 
+/* export files resolved to their ION handle, dropped on PVRSRVRelease */
+struct export_entry {
+	struct hlist_node node;
+	struct file *file;
+	struct ion_handle *handle;
+	struct rcu_head rcu;
+};
+
+#define EXPORT_HASH_BITS 6
+static struct hlist_head export_hash[1 << EXPORT_HASH_BITS];
+static DEFINE_SPINLOCK(export_lock);
+// the cache is only safe to use once the release hook is in place
+static bool export_cache = false;
+
+static struct ion_handle *export_cache_find(struct file *file)
+{
+	struct hlist_head *head = &export_hash[hash_ptr(file, EXPORT_HASH_BITS)];
+	struct ion_handle *handle = IMG_NULL;
+	struct export_entry *e;
+	struct hlist_node *pos;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(e, pos, head, node) {
+		if (e->file == file) {
+			handle = e->handle;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return handle;
+}
+
+static void export_cache_add(struct file *file, struct ion_handle *handle)
+{
+	struct hlist_head *head = &export_hash[hash_ptr(file, EXPORT_HASH_BITS)];
+	struct export_entry *e, *new;
+	struct hlist_node *pos;
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		return;
+	new->file = file;
+	new->handle = handle;
+
+	spin_lock(&export_lock);
+	hlist_for_each_entry(e, pos, head, node) {
+		if (e->file == file) {
+			spin_unlock(&export_lock);
+			kfree(new);
+			return;
+		}
+	}
+	hlist_add_head_rcu(&new->node, head);
+	spin_unlock(&export_lock);
+}
+
+static void export_entry_free(struct rcu_head *rcu)
+{
+	kfree(container_of(rcu, struct export_entry, rcu));
+}
+
+static void export_cache_drop(struct file *file)
+{
+	struct hlist_head *head = &export_hash[hash_ptr(file, EXPORT_HASH_BITS)];
+	struct export_entry *e;
+	struct hlist_node *pos;
+
+	spin_lock(&export_lock);
+	hlist_for_each_entry(e, pos, head, node) {
+		if (e->file == file) {
+			hlist_del_rcu(&e->node);
+			call_rcu(&e->rcu, export_entry_free);
+			break;
+		}
+	}
+	spin_unlock(&export_lock);
+}
+
+static void export_cache_flush(void)
+{
+	struct export_entry *e;
+	struct hlist_node *pos, *n;
+	int i;
+
+	spin_lock(&export_lock);
+	for (i = 0; i < ARRAY_SIZE(export_hash); i++) {
+		hlist_for_each_entry_safe(e, pos, n, &export_hash[i], node) {
+			hlist_del_rcu(&e->node);
+			call_rcu(&e->rcu, export_entry_free);
+		}
+	}
+	spin_unlock(&export_lock);
+	rcu_barrier();
+}
+
 struct ion_handle *
 PVRSRVExportFDToIONHandle(int fd, struct ion_client **client)
 {
@@ -90,12 +189,24 @@ PVRSRVExportFDToIONHandle(int fd, struct ion_client **client)
 		return psIONHandle;
 	}
 
-	/* Take the bridge mutex so the handle won't be freed underneath us */
-	LinuxLockMutex(&gPVRSRVLock);
-
 	psFile = fget(fd);
 	if(!psFile)
-		goto err_unlock;
+		return psIONHandle;
+
+	if(export_cache)
+	{
+		psIONHandle = export_cache_find(psFile);
+		if(psIONHandle)
+		{
+			if(client)
+				*client = gpsIONClient;
+			fput(psFile);
+			return psIONHandle;
+		}
+	}
+
+	/* Take the bridge mutex so the handle won't be freed underneath us */
+	LinuxLockMutex(&gPVRSRVLock);
 
 	psPrivateData = psFile->private_data;
 	if(!psPrivateData)
@@ -105,7 +216,6 @@ PVRSRVExportFDToIONHandle(int fd, struct ion_client **client)
 		goto err_fput;
 	}
 
-	SYMSEARCH_BIND_FUNCTION_TO_TYPED(ionpvr, struct ion_handle *, PVRSRVLookupHandle, _PVRSRVLookupHandle);
 	eError = _PVRSRVLookupHandle(psKernelHandleBase,
 								(IMG_PVOID *)&psKernelMemInfo,
 								psPrivateData->hKernelMemInfo,
@@ -131,12 +241,13 @@ PVRSRVExportFDToIONHandle(int fd, struct ion_client **client)
 	//psIONHandle = sIONTilerAlloc.psIONHandle;
 	if(client)
 		*client = gpsIONClient;
+	if(export_cache)
+		export_cache_add(psFile, psIONHandle);
 
 err_fput:
-	fput(psFile);
-err_unlock:
 	/* Allow PVRSRV clients to communicate with srvkm again */
 	LinuxUnLockMutex(&gPVRSRVLock);
+	fput(psFile);
 	return psIONHandle;
 }
 EXPORT_SYMBOL(PVRSRVExportFDToIONHandle);
@@ -492,22 +603,30 @@ static void ProcSeqShowSysNodes(struct seq_file *sfile, void* el) {
 	}
 	HOOK_INVOKE(ProcSeqShowSysNodes, sfile, el);
 	if (el > PVR_PROC_SEQ_START_TOKEN) {
-		// last one, stop hooking
+		// last one, stop hooking (the release hook stays)
 		if (psDevNode->psNext == NULL) {
-			hook_exit();
-			hooked = false;
+			unhook(&g_hi[0]);
 		}
 	}
 }
 
+/* hooked release of PVR files, export fds included */
+static int PVRSRVRelease(struct inode *pInode, struct file *pFile) {
+	export_cache_drop(pFile);
+	return HOOK_INVOKE(PVRSRVRelease, pInode, pFile);
+}
+
 struct hook_info g_hi[] = {
 	HOOK_INIT(ProcSeqShowSysNodes), // when /proc/pvr/nodes is read (cat)
+	HOOK_INIT(PVRSRVRelease),       // drops the export cache entry of a file
 	HOOK_INIT_END
 };
 
 int __init init_ionpvr(void) {
+	SYMSEARCH_BIND_FUNCTION_TO(ionpvr, PVRSRVLookupHandle, _PVRSRVLookupHandle);
 	hook_init();
 	hooked = true;
+	export_cache = g_hi[1].hooked;
 	return sniff_handle_base();
 }
 int release_sgx(void) {
@@ -525,6 +644,8 @@ void __exit exit_ionpvr(void) {
 	if (hooked) {
 		hook_exit();
 	}
+	export_cache = false;
+	export_cache_flush();
 	release_sgx();
 }
 